@@ -0,0 +1,68 @@
+#pragma once
+// The subset of the Arduino API that the firmware uses, implemented on the
+// host by sim.cpp. NOTE: int is 32 bits here instead of 16.
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define PROGMEM
+#define pgm_read_byte(p) (*(const uint8_t*)(p))
+#define pgm_read_word(p) (*(const uint16_t*)(p))
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+
+static const uint8_t A0 = 14;
+static const uint8_t A1 = 15;
+static const uint8_t A2 = 16;
+static const uint8_t A3 = 17;
+static const uint8_t A4 = 18;
+static const uint8_t A5 = 19;
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+class __FlashStringHelper;
+#define F(s) (reinterpret_cast<const __FlashStringHelper*>(s))
+
+uint32_t millis();
+void delay(uint32_t ms);
+void delayMicroseconds(unsigned int us);
+void _delay_ms(double ms);
+void _delay_us(double us);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+int analogRead(uint8_t pin);
+
+class HardwareSerial
+{
+public:
+	void begin(unsigned long baud);
+	int available();
+	int read();
+	size_t write(const char *data, size_t len);
+
+	size_t print(const char *s);
+	size_t print(const __FlashStringHelper *s);
+	size_t print(char c);
+	size_t print(int i);
+	size_t print(unsigned int i);
+	size_t print(long i);
+	size_t print(unsigned long i);
+	size_t println();
+	template<typename T>
+	size_t println(T v){
+		size_t n = print(v);
+		return n + println();
+	}
+};
+
+extern HardwareSerial Serial;
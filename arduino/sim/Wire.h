@@ -0,0 +1,18 @@
+#pragma once
+// I2C as used by ar1010lib.cpp. sim.cpp answers as an AR1010 whose tuning
+// always completes immediately.
+#include "Arduino.h"
+
+class TwoWire
+{
+public:
+	void begin();
+	void beginTransmission(uint8_t address);
+	size_t write(uint8_t b);
+	uint8_t endTransmission();
+	uint8_t requestFrom(int address, int quantity);
+	int available();
+	int read();
+};
+
+extern TwoWire Wire;
@@ -0,0 +1,6 @@
+#pragma once
+// EEPROM backed by memory, and by a file if sim is given -e
+#include <stdint.h>
+
+uint8_t eeprom_read_byte(const uint8_t *p);
+void eeprom_write_byte(uint8_t *p, uint8_t value);
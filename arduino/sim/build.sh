@@ -0,0 +1,8 @@
+#!/bin/sh
+# Builds the firmware for the host as sim/firmware_sim; see sim/sim.cpp.
+# Run from the arduino directory, like build.sh.
+echo -n "static const char *VERSION_STRING = \"" > version.h
+echo -n $(md5sum src/sketch.ino | cut -d' ' -f1) >> version.h
+echo "\";" >> version.h
+grep -E '^[A-Za-z_][A-Za-z0-9_ \*]* \**[A-Za-z_0-9]+\(.*\)$' src/sketch.ino | sed 's/$/;/' > sim/sketch_prototypes.h
+g++ -o sim/firmware_sim -Isim -Isrc sim/sketch_sim.cpp src/lcd.cpp src/ar1010lib.cpp sim/sim.cpp
@@ -0,0 +1,584 @@
+// Host build of the firmware, for testing the serial protocol and timing
+// without the hardware. Build with sim/build.sh.
+//
+// The serial port is a pseudo terminal. Its path is printed at startup (and
+// symlinked to the path given with -l), so opts can open it with -s.
+//
+// Commands on stdin:
+//   press <key>        Press a key of the LCD controller (eg. 22 = power)
+//   release <key>
+//   rotate <steps>     Turn the rotary encoder; negative = counterclockwise
+//   ignition <0/1>
+//   temp <celsius>     Temperature seen by heat_up() when powering on
+//   quit
+//
+// The display is decoded back to text and printed whenever it changes, as
+// are the power related pins. Each line starts with millis().
+#include "Arduino.h"
+#include "Wire.h"
+#include "avr/eeprom.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <termios.h>
+#include <poll.h>
+#include <time.h>
+#include <stdarg.h>
+
+void setup();
+void loop();
+extern const uint8_t SEG_I_14[];
+extern const uint16_t CHAR_MAP_14SEG[];
+
+// Must match sketch.ino
+static const uint8_t PIN_MAIN_POWER_CONTROL = 4;
+static const uint8_t PIN_LCD_CE = 7;
+static const uint8_t PIN_LCD_CL = 8;
+static const uint8_t PIN_LCD_DI = 9;
+static const uint8_t PIN_LCD_DO = 10;
+static const uint8_t PIN_ENCODER1 = A0;
+static const uint8_t PIN_ENCODER2 = A1;
+static const uint8_t PIN_STANDBY_DISABLE = 5;
+static const uint8_t PIN_RASPBERRY_POWER_OFF = 2;
+static const uint8_t PIN_IGNITION_INPUT = A2;
+static const uint8_t PIN_TEMPERATURE = A3;
+static const uint8_t PIN_HEATER = 6;
+// Must match render_raspberry_extras() in sketch.ino
+static const uint8_t PROGRESS_SEGMENTS[] = {
+	14, 19, 23, 15, 93, 92, 135, 165, 164,
+};
+static const uint8_t DISPLAY_FLAG_SEGMENTS[] = {
+	111, 115, 127, 130, 131, 99,
+};
+// Must match read_temperature() in sketch.ino
+static const float THERMISTOR_R_NOMINAL = 12000;
+static const float THERMISTOR_T_NOMINAL = 25;
+static const float THERMISTOR_B_COEFF = 3500;
+static const float THERMISTOR_R_SERIES = 40000;
+
+static bool g_verbose = false;
+static uint8_t g_pins[32];
+static bool g_ignition = true;
+static float g_temperature_c = 22;
+static uint8_t g_keys[4];
+static uint8_t g_encoder_state = 0; // bit 0 = PIN_ENCODER1, bit 1 = PIN_ENCODER2
+static int g_encoder_pending_steps = 0;
+static uint8_t g_eeprom[1024];
+static const char *g_eeprom_path = NULL;
+static struct timespec g_start_time;
+
+static void sim_log(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static void sim_log(const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	printf("%8u ", millis());
+	vprintf(fmt, args);
+	va_end(args);
+	fflush(stdout);
+}
+
+/*
+	Time
+*/
+
+uint32_t millis()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec - g_start_time.tv_sec) * 1000 +
+			(ts.tv_nsec - g_start_time.tv_nsec) / 1000000;
+}
+
+void delay(uint32_t ms) { usleep(ms * 1000); }
+void delayMicroseconds(unsigned int us) { usleep(us); }
+void _delay_ms(double ms) { usleep(ms * 1000); }
+// Bit-banging delays are far below what matters here
+void _delay_us(double us) {}
+
+/*
+	LCD controller
+
+	Decodes the bit-banged protocol of lcd_send_display() and
+	lcd_receive_frame(): an address byte is clocked in while CE is low, after
+	which data is clocked in (0x42) or key data out (0x43) while CE is high.
+	Bits are LSB first.
+*/
+
+struct LcdController {
+	uint8_t address = 0;
+	uint8_t in_bytes[7];
+	int in_bits = 0;
+	int out_bits = 0;
+	uint8_t display[21];
+	uint8_t shown_display[21];
+};
+static LcdController g_lcd;
+
+static bool display_segment(const uint8_t *data, uint8_t seg)
+{
+	return data[seg / 8] & (1 << (seg % 8));
+}
+
+static char decode_segment_char(const uint8_t *data, uint8_t digit)
+{
+	uint16_t bits = 0;
+	for(uint8_t i=0; i<14; i++){
+		if(display_segment(data, SEG_I_14[digit * 14 + i]))
+			bits |= 1 << i;
+	}
+	// Several characters share a pattern; prefer the ones the host sends
+	static const char *preferred = " ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-|";
+	for(const char *p = preferred; *p; p++){
+		if(CHAR_MAP_14SEG[(uint8_t)*p] == bits)
+			return *p;
+	}
+	for(int c = 32; c < 127; c++){
+		if(CHAR_MAP_14SEG[c] == bits)
+			return c;
+	}
+	return '?';
+}
+
+static void print_display()
+{
+	const uint8_t *data = g_lcd.display;
+	char text[9];
+	for(uint8_t i=0; i<8; i++)
+		text[i] = decode_segment_char(data, i);
+	text[8] = 0;
+	char progress[sizeof PROGRESS_SEGMENTS + 1];
+	for(uint8_t i=0; i<sizeof PROGRESS_SEGMENTS; i++)
+		progress[i] = display_segment(data, PROGRESS_SEGMENTS[i]) ? '#' : '.';
+	progress[sizeof PROGRESS_SEGMENTS] = 0;
+	uint8_t flags = 0;
+	for(uint8_t i=0; i<sizeof DISPLAY_FLAG_SEGMENTS; i++){
+		if(display_segment(data, DISPLAY_FLAG_SEGMENTS[i]))
+			flags |= 1 << i;
+	}
+	sim_log("LCD [%s] %s flags=%02x\n", text, progress, flags);
+}
+
+static void lcd_ce_changed(bool ce)
+{
+	if(ce){
+		g_lcd.in_bits = 0;
+		g_lcd.out_bits = 0;
+		memset(g_lcd.in_bytes, 0, sizeof g_lcd.in_bytes);
+		return;
+	}
+	if(g_lcd.address != 0x42 || g_lcd.in_bits != 56)
+		return;
+	// The last byte tells which part of the display the data is for
+	const uint8_t *in = g_lcd.in_bytes;
+	switch(in[6] & 0xc0){
+	case 0x00:
+		memcpy(&g_lcd.display[0], in, 5);
+		g_lcd.display[5] = in[5] & 0x0f;
+		break;
+	case 0x80:
+		memcpy(&g_lcd.display[6], in, 5);
+		break;
+	case 0x40:
+		memcpy(&g_lcd.display[11], in, 5);
+		break;
+	case 0xc0:
+		// Sent last
+		memcpy(&g_lcd.display[16], in, 5);
+		if(memcmp(g_lcd.display, g_lcd.shown_display, sizeof g_lcd.display) != 0){
+			memcpy(g_lcd.shown_display, g_lcd.display, sizeof g_lcd.display);
+			print_display();
+		}
+		break;
+	}
+}
+
+static void lcd_clock_rising()
+{
+	bool di = g_pins[PIN_LCD_DI];
+	if(!g_pins[PIN_LCD_CE]){
+		g_lcd.address = (g_lcd.address >> 1) | (di ? 0x80 : 0);
+	} else if(g_lcd.address == 0x42){
+		if(g_lcd.in_bits < 56){
+			if(di)
+				g_lcd.in_bytes[g_lcd.in_bits / 8] |= 1 << (g_lcd.in_bits % 8);
+			g_lcd.in_bits++;
+		}
+	} else if(g_lcd.address == 0x43){
+		g_lcd.out_bits++;
+	}
+}
+
+static int lcd_read_do()
+{
+	if(g_pins[PIN_LCD_CE] && g_lcd.address == 0x43){
+		int bit = g_lcd.out_bits - 1;
+		if(bit < 0 || bit >= 32)
+			return LOW;
+		return (g_keys[bit / 8] & (1 << (bit % 8))) ? HIGH : LOW;
+	}
+	// Key data is available while any key is pressed
+	bool any_key = g_keys[0] || g_keys[1] || g_keys[2] || g_keys[3];
+	return any_key ? LOW : HIGH;
+}
+
+/*
+	Pins
+*/
+
+static const char* logged_pin_name(uint8_t pin)
+{
+	switch(pin){
+	case PIN_MAIN_POWER_CONTROL: return "MAIN_POWER_CONTROL";
+	case PIN_STANDBY_DISABLE: return "STANDBY_DISABLE";
+	case PIN_RASPBERRY_POWER_OFF: return "RASPBERRY_POWER_OFF";
+	case PIN_HEATER: return "HEATER";
+	}
+	return NULL;
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {}
+
+void digitalWrite(uint8_t pin, uint8_t value)
+{
+	if(pin >= sizeof g_pins)
+		return;
+	bool old = g_pins[pin];
+	g_pins[pin] = value ? 1 : 0;
+	if(old == g_pins[pin])
+		return;
+	if(pin == PIN_LCD_CE)
+		lcd_ce_changed(g_pins[pin]);
+	else if(pin == PIN_LCD_CL && g_pins[pin])
+		lcd_clock_rising();
+	else if(const char *name = logged_pin_name(pin))
+		sim_log("PIN %s %i\n", name, g_pins[pin]);
+}
+
+int digitalRead(uint8_t pin)
+{
+	if(pin == PIN_LCD_DO)
+		return lcd_read_do();
+	if(pin == PIN_IGNITION_INPUT)
+		return g_ignition ? HIGH : LOW;
+	if(pin == PIN_ENCODER1)
+		return (g_encoder_state & 1) ? HIGH : LOW;
+	if(pin == PIN_ENCODER2)
+		return (g_encoder_state & 2) ? HIGH : LOW;
+	if(pin < sizeof g_pins)
+		return g_pins[pin];
+	return LOW;
+}
+
+int analogRead(uint8_t pin)
+{
+	if(pin != PIN_TEMPERATURE)
+		return 0;
+	// Inverse of read_temperature()
+	float t = g_temperature_c + 273.15f;
+	float r = THERMISTOR_R_NOMINAL * expf(THERMISTOR_B_COEFF *
+			(1.0f / t - 1.0f / (THERMISTOR_T_NOMINAL + 273.15f)));
+	return 1023.0f * r / (r + THERMISTOR_R_SERIES) + 0.5f;
+}
+
+// Steps through the quadrature sequence used by handle_encoder()
+static void step_encoder()
+{
+	static const uint8_t SEQUENCE[] = {0, 1, 3, 2};
+	uint8_t i = 0;
+	while(SEQUENCE[i] != g_encoder_state)
+		i++;
+	if(g_encoder_pending_steps > 0){
+		g_encoder_state = SEQUENCE[(i + 1) % 4];
+		g_encoder_pending_steps--;
+	} else if(g_encoder_pending_steps < 0){
+		g_encoder_state = SEQUENCE[(i + 3) % 4];
+		g_encoder_pending_steps++;
+	}
+}
+
+/*
+	Serial
+*/
+
+HardwareSerial Serial;
+static int g_serial_fd = -1;
+static char g_serial_rx[256];
+static size_t g_serial_rx_len = 0;
+static size_t g_serial_rx_pos = 0;
+static char g_serial_tx_line[256];
+static size_t g_serial_tx_line_len = 0;
+
+void HardwareSerial::begin(unsigned long baud) {}
+
+int HardwareSerial::available()
+{
+	if(g_serial_rx_pos < g_serial_rx_len)
+		return g_serial_rx_len - g_serial_rx_pos;
+	ssize_t r = ::read(g_serial_fd, g_serial_rx, sizeof g_serial_rx);
+	if(r <= 0)
+		return 0;
+	g_serial_rx_len = r;
+	g_serial_rx_pos = 0;
+	if(g_verbose)
+		sim_log("SERIAL IN %.*s", (int)r, g_serial_rx);
+	return r;
+}
+
+int HardwareSerial::read()
+{
+	if(!available())
+		return -1;
+	return (uint8_t)g_serial_rx[g_serial_rx_pos++];
+}
+
+size_t HardwareSerial::write(const char *data, size_t len)
+{
+	if(g_verbose){
+		for(size_t i=0; i<len; i++){
+			if(data[i] == '\n' || g_serial_tx_line_len == sizeof g_serial_tx_line - 1){
+				g_serial_tx_line[g_serial_tx_line_len] = 0;
+				sim_log("SERIAL OUT %s\n", g_serial_tx_line);
+				g_serial_tx_line_len = 0;
+			} else if(data[i] != '\r'){
+				g_serial_tx_line[g_serial_tx_line_len++] = data[i];
+			}
+		}
+	}
+	// Nobody may have the port open; that's fine
+	ssize_t r = ::write(g_serial_fd, data, len);
+	return r < 0 ? 0 : r;
+}
+
+size_t HardwareSerial::print(const char *s) { return write(s, strlen(s)); }
+size_t HardwareSerial::print(const __FlashStringHelper *s) { return print((const char*)s); }
+size_t HardwareSerial::print(char c) { return write(&c, 1); }
+size_t HardwareSerial::print(int i) { return print((long)i); }
+size_t HardwareSerial::print(unsigned int i) { return print((unsigned long)i); }
+size_t HardwareSerial::println() { return write("\r\n", 2); }
+
+size_t HardwareSerial::print(long i)
+{
+	char buf[24];
+	snprintf(buf, sizeof buf, "%li", i);
+	return print(buf);
+}
+
+size_t HardwareSerial::print(unsigned long i)
+{
+	char buf[24];
+	snprintf(buf, sizeof buf, "%lu", i);
+	return print(buf);
+}
+
+/*
+	I2C: AR1010 registers
+*/
+
+TwoWire Wire;
+static uint16_t g_ar1010_registers[18];
+static uint8_t g_wire_tx[3];
+static size_t g_wire_tx_len = 0;
+static uint8_t g_wire_rx[2];
+static size_t g_wire_rx_len = 0;
+static size_t g_wire_rx_pos = 0;
+
+void TwoWire::begin() {}
+
+void TwoWire::beginTransmission(uint8_t address)
+{
+	g_wire_tx_len = 0;
+}
+
+size_t TwoWire::write(uint8_t b)
+{
+	if(g_wire_tx_len < sizeof g_wire_tx)
+		g_wire_tx[g_wire_tx_len++] = b;
+	return 1;
+}
+
+uint8_t TwoWire::endTransmission()
+{
+	if(g_wire_tx_len == 3 && g_wire_tx[0] < 18)
+		g_ar1010_registers[g_wire_tx[0]] = (g_wire_tx[1] << 8) | g_wire_tx[2];
+	return 0;
+}
+
+uint8_t TwoWire::requestFrom(int address, int quantity)
+{
+	uint8_t reg = g_wire_tx_len > 0 ? g_wire_tx[0] : 0;
+	uint16_t value = 0;
+	if(reg < 18)
+		value = g_ar1010_registers[reg];
+	if(reg == 0x13){
+		// Status: tuning complete (STC) on the channel that was set
+		value = 0x0020 | ((g_ar1010_registers[2] & 0x01ff) << 7);
+	}
+	g_wire_rx[0] = value >> 8;
+	g_wire_rx[1] = value & 0xff;
+	g_wire_rx_len = 2;
+	g_wire_rx_pos = 0;
+	return 2;
+}
+
+int TwoWire::available() { return g_wire_rx_len - g_wire_rx_pos; }
+
+int TwoWire::read()
+{
+	if(g_wire_rx_pos >= g_wire_rx_len)
+		return -1;
+	return g_wire_rx[g_wire_rx_pos++];
+}
+
+/*
+	EEPROM
+*/
+
+uint8_t eeprom_read_byte(const uint8_t *p)
+{
+	size_t a = (size_t)p;
+	return a < sizeof g_eeprom ? g_eeprom[a] : 0xff;
+}
+
+void eeprom_write_byte(uint8_t *p, uint8_t value)
+{
+	size_t a = (size_t)p;
+	if(a >= sizeof g_eeprom)
+		return;
+	g_eeprom[a] = value;
+	if(g_eeprom_path){
+		FILE *f = fopen(g_eeprom_path, "wb");
+		if(f){
+			fwrite(g_eeprom, 1, sizeof g_eeprom, f);
+			fclose(f);
+		}
+	}
+}
+
+static void load_eeprom()
+{
+	memset(g_eeprom, 0xff, sizeof g_eeprom);
+	if(!g_eeprom_path)
+		return;
+	FILE *f = fopen(g_eeprom_path, "rb");
+	if(!f)
+		return;
+	size_t r = fread(g_eeprom, 1, sizeof g_eeprom, f);
+	(void)r;
+	fclose(f);
+}
+
+/*
+	Control
+*/
+
+static bool handle_stdin_command(const char *line)
+{
+	int v = 0;
+	float f = 0;
+	if(sscanf(line, "press %i", &v) == 1 && v >= 0 && v < 32){
+		g_keys[v / 8] |= 1 << (v % 8);
+	} else if(sscanf(line, "release %i", &v) == 1 && v >= 0 && v < 32){
+		g_keys[v / 8] &= ~(1 << (v % 8));
+	} else if(sscanf(line, "rotate %i", &v) == 1){
+		g_encoder_pending_steps += v;
+	} else if(sscanf(line, "ignition %i", &v) == 1){
+		g_ignition = v != 0;
+	} else if(sscanf(line, "temp %f", &f) == 1){
+		g_temperature_c = f;
+	} else if(strncmp(line, "quit", 4) == 0){
+		return false;
+	} else if(line[0] != '\n'){
+		sim_log("Unknown command: %s", line);
+	}
+	return true;
+}
+
+static bool handle_stdin()
+{
+	struct pollfd fds;
+	fds.fd = STDIN_FILENO;
+	fds.events = POLLIN;
+	if(poll(&fds, 1, 0) <= 0)
+		return true;
+	static char line[100];
+	if(fgets(line, sizeof line, stdin) == NULL)
+		return true; // Keep running without stdin
+	return handle_stdin_command(line);
+}
+
+static int open_serial_pty(const char *link_path)
+{
+	int fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if(fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0){
+		perror("posix_openpt");
+		return -1;
+	}
+	const char *slave_path = ptsname(fd);
+	// Keeping the slave open avoids EIO on the master while nobody else has it
+	// open, and makes it raw like a real serial port
+	int slave_fd = open(slave_path, O_RDWR | O_NOCTTY);
+	if(slave_fd >= 0){
+		struct termios tty;
+		if(tcgetattr(slave_fd, &tty) == 0){
+			cfmakeraw(&tty);
+			tcsetattr(slave_fd, TCSANOW, &tty);
+		}
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	printf("Serial port: %s\n", slave_path);
+	if(link_path){
+		unlink(link_path);
+		if(symlink(slave_path, link_path) != 0)
+			perror("symlink");
+		else
+			printf("Serial port link: %s\n", link_path);
+	}
+	fflush(stdout);
+	return fd;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *link_path = NULL;
+	int c;
+	while((c = getopt(argc, argv, "hl:e:v")) != -1){
+		switch(c){
+		case 'l':
+			link_path = optarg;
+			break;
+		case 'e':
+			g_eeprom_path = optarg;
+			break;
+		case 'v':
+			g_verbose = true;
+			break;
+		default:
+			printf("Usage: %s [OPTION]...\n"
+					"  -h          Show this help\n"
+					"  -l [path]   Create a symlink to the serial port\n"
+					"  -e [path]   Keep EEPROM contents in this file\n"
+					"  -v          Print serial traffic\n", argv[0]);
+			return 1;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &g_start_time);
+	load_eeprom();
+	g_serial_fd = open_serial_pty(link_path);
+	if(g_serial_fd < 0)
+		return 1;
+
+	setup();
+	for(;;){
+		if(!handle_stdin())
+			break;
+		step_encoder();
+		loop();
+		// A real loop() takes about this long due to bit-banging the LCD
+		usleep(1000);
+	}
+	if(link_path)
+		unlink(link_path);
+	return 0;
+}
@@ -0,0 +1,6 @@
+// Compiles sketch.ino the way the Arduino build does: Arduino.h first and a
+// prototype for every function, so that they can be used before definition.
+// build.sh generates the prototypes.
+#include "Arduino.h"
+#include "sketch_prototypes.h"
+#include "../src/sketch.ino"
@@ -124,7 +124,7 @@ VolumeControls g_volume_controls;
 
 //uint8_t g_debug_test_segment_i = 0;
 
-CommandAccumulator<50> command_accumulator;
+CommandAccumulator<FIRMWARE_COMMAND_BUFFER_SIZE> command_accumulator;
 
 enum ControlMode {
 	CM_POWER_OFF,
@@ -175,9 +175,65 @@ Mode CONTROL_MODES[] = {
 };
 
 char g_raspberry_display_text[9] = "RASPBERR";
+// >SCROLL_TEXT: Pieces separated by '\t', shown one at a time followed by a
+// separator, repeating until other text is set
+#define SCROLL_POS_SEPARATOR 0xff
+bool g_raspberry_scrolling = false;
+char g_raspberry_scroll_text[FIRMWARE_COMMAND_BUFFER_SIZE - 16] = {0};
+uint8_t g_raspberry_scroll_pos = 0; // Start of current piece
+uint16_t g_raspberry_scroll_first_piece_ms = 1000;
+uint16_t g_raspberry_scroll_piece_ms = 1000;
+uint16_t g_raspberry_scroll_timer = 0; // milliseconds; counts down
 uint8_t g_raspberry_display_progress = 0; // 0-255
+// >TRACK: The progress bar is extrapolated from these; 0 duration = use
+// g_raspberry_display_progress as set by >PROGRESS
+uint32_t g_track_duration_ms = 0;
+uint32_t g_track_position_ms = 0;
+uint32_t g_track_position_timestamp = 0;
+bool g_track_playing = false;
 uint8_t g_raspberry_display_extra_segments = 0;
 
+void raspberry_show_scroll_piece()
+{
+	const char *p = &g_raspberry_scroll_text[g_raspberry_scroll_pos];
+	uint8_t i = 0;
+	for(; i < sizeof g_raspberry_display_text - 1 && p[i] != 0 && p[i] != '\t'; i++)
+		g_raspberry_display_text[i] = p[i];
+	g_raspberry_display_text[i] = 0;
+}
+
+void raspberry_start_scroll()
+{
+	g_raspberry_scrolling = true;
+	g_raspberry_scroll_pos = 0;
+	g_raspberry_scroll_timer = g_raspberry_scroll_first_piece_ms;
+	raspberry_show_scroll_piece();
+}
+
+void update_raspberry_scroll(uint32_t dt_ms)
+{
+	if(!g_raspberry_scrolling)
+		return;
+	if(g_raspberry_scroll_timer > dt_ms){
+		g_raspberry_scroll_timer -= dt_ms;
+		return;
+	}
+	if(g_raspberry_scroll_pos == SCROLL_POS_SEPARATOR){
+		raspberry_start_scroll();
+		return;
+	}
+	const char *next = strchr(&g_raspberry_scroll_text[g_raspberry_scroll_pos], '\t');
+	if(next){
+		g_raspberry_scroll_pos = next - g_raspberry_scroll_text + 1;
+		g_raspberry_scroll_timer = g_raspberry_scroll_piece_ms;
+		raspberry_show_scroll_piece();
+	} else {
+		g_raspberry_scroll_pos = SCROLL_POS_SEPARATOR;
+		g_raspberry_scroll_timer = g_raspberry_scroll_piece_ms / 2;
+		snprintf(g_raspberry_display_text, sizeof g_raspberry_display_text, " - - -  ");
+	}
+}
+
 void power_off_update()
 {
 	reset_display_data(g_display_data);
@@ -263,8 +319,23 @@ void render_raspberry_extras(uint8_t *data)
 	}
 }
 
+void update_track_progress()
+{
+	if(g_track_duration_ms == 0)
+		return;
+	uint32_t position_ms = g_track_position_ms;
+	if(g_track_playing)
+		position_ms += millis() - g_track_position_timestamp;
+	// Avoids 64-bit arithmetic; resolution is plenty for the bar
+	uint32_t ms_per_step = g_track_duration_ms / 255 + 1;
+	uint32_t progress = position_ms / ms_per_step;
+	g_raspberry_display_progress = progress > 255 ? 255 : progress;
+}
+
 void raspberry_update()
 {
+	update_track_progress();
+
 	// Update LCD
 	{
 		reset_display_data(g_display_data);
@@ -890,11 +961,31 @@ void handle_serial()
 			Serial.println(VERSION_STRING);
 			continue;
 		}
+		if(strcmp(command, ">CAPS") == 0){
+			Serial.println(F("<CAPS:SCROLL_TEXT,TRACK"));
+			continue;
+		}
 		if(strncmp(command, ">SET_TEXT:", 10) == 0){
 			const char *text = &command[10];
+			g_raspberry_scrolling = false;
 			snprintf(g_raspberry_display_text, sizeof g_raspberry_display_text, text);
 			continue;
 		}
+		// >SCROLL_TEXT:<first piece ms>:<piece ms>:<piece>\t<piece>...
+		if(strncmp(command, ">SCROLL_TEXT:", 13) == 0){
+			char *end;
+			uint16_t first_piece_ms = strtoul(&command[13], &end, 10);
+			if(*end != ':')
+				continue;
+			uint16_t piece_ms = strtoul(end + 1, &end, 10);
+			if(*end != ':')
+				continue;
+			g_raspberry_scroll_first_piece_ms = first_piece_ms;
+			g_raspberry_scroll_piece_ms = piece_ms;
+			snprintf(g_raspberry_scroll_text, sizeof g_raspberry_scroll_text, "%s", end + 1);
+			raspberry_start_scroll();
+			continue;
+		}
 		if(strncmp(command, ">SET_TEMP_TEXT:", 15) == 0){
 			if(g_control_mode == CM_RASPBERRY){
 				const char *text = &command[15];
@@ -908,9 +999,25 @@ void handle_serial()
 			continue;
 		}
 		if(strncmp(command, ">PROGRESS:", 10) == 0){
+			g_track_duration_ms = 0;
 			g_raspberry_display_progress = atoi(&command[10]);
 			continue;
 		}
+		// >TRACK:<duration ms>:<position ms>:<playing (0/1)>
+		if(strncmp(command, ">TRACK:", 7) == 0){
+			char *end;
+			uint32_t duration_ms = strtoul(&command[7], &end, 10);
+			if(*end != ':')
+				continue;
+			uint32_t position_ms = strtoul(end + 1, &end, 10);
+			if(*end != ':')
+				continue;
+			g_track_duration_ms = duration_ms;
+			g_track_position_ms = position_ms;
+			g_track_position_timestamp = millis();
+			g_track_playing = atoi(end + 1) != 0;
+			continue;
+		}
 		if(strncmp(command, ">EXTRA_SEGMENTS:", 16) == 0){
 			g_raspberry_display_extra_segments = atoi(&command[16]);
 			if(g_control_mode == CM_RASPBERRY){
@@ -1318,6 +1425,7 @@ void loop()
 				// Power down raspberry pi
 				digitalWrite(PIN_RASPBERRY_POWER_OFF, HIGH);
 				// Reset text
+				g_raspberry_scrolling = false;
 				snprintf(g_raspberry_display_text, sizeof g_raspberry_display_text,
 						"RASPBERR");
 			}
@@ -1356,6 +1464,8 @@ void loop()
 			g_config_menu_show_timer -= dt_ms;
 		else
 			g_config_menu_show_timer = 0;
+
+		update_raspberry_scroll(dt_ms);
 	}
 
 	handle_encoder();
@@ -0,0 +1,139 @@
+// Plays a file with libmpv for a fixed time, first as opts loads it without
+// file-local options and then with the options of its media type, and
+// reports the CPU time of each as seconds per hour of playback. Meant to be
+// run on the target board. See build.sh.
+//
+// Usage: bench/audio_only_cpu <file> [seconds (default: 60)] [ao (default: auto)]
+#include "../src/media_types.hpp"
+#include <mpv/client.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static double get_cpu_seconds()
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+			(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static double get_wall_seconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Loads the file the way mpv_loadfile() in mpv_control.cpp does
+static int loadfile(mpv_handle *mpv, const char *path, const char *options)
+{
+	if(options[0] == 0){
+		const char *cmd[] = {"loadfile", path, NULL};
+		return mpv_command(mpv, cmd);
+	}
+	const char *keys[] = {"name", "url", "options"};
+	const char *values[] = {"loadfile", path, options};
+	mpv_node nodes[3];
+	for(int i=0; i<3; i++){
+		nodes[i].format = MPV_FORMAT_STRING;
+		nodes[i].u.string = (char*)values[i];
+	}
+	mpv_node_list list;
+	list.num = 3;
+	list.values = nodes;
+	list.keys = (char**)keys;
+	mpv_node args;
+	args.format = MPV_FORMAT_NODE_MAP;
+	args.u.list = &list;
+	mpv_node result;
+	int status = mpv_command_node(mpv, &args, &result);
+	if(status >= 0)
+		mpv_free_node_contents(&result);
+	return status;
+}
+
+// Returns false if the file couldn't be played
+static bool measure(const char *path, const char *options, double seconds,
+		const char *ao)
+{
+	mpv_handle *mpv = mpv_create();
+	if(mpv == NULL){
+		fprintf(stderr, "mpv_create() failed\n");
+		return false;
+	}
+	// Same as opts
+	mpv_set_option_string(mpv, "vo", "null");
+	if(ao)
+		mpv_set_option_string(mpv, "ao", ao);
+	if(mpv_initialize(mpv) < 0){
+		fprintf(stderr, "mpv_initialize() failed\n");
+		mpv_terminate_destroy(mpv);
+		return false;
+	}
+	int status = loadfile(mpv, path, options);
+	if(status < 0){
+		fprintf(stderr, "loadfile failed: %s\n", mpv_error_string(status));
+		mpv_terminate_destroy(mpv);
+		return false;
+	}
+	// Measure from the start of playback so that opening the file and
+	// initializing the decoders aren't counted
+	double cpu0 = 0, wall0 = 0;
+	bool playing = false;
+	bool ok = true;
+	for(;;){
+		double now = get_wall_seconds();
+		if(playing && now - wall0 >= seconds)
+			break;
+		mpv_event *event = mpv_wait_event(mpv, playing ? seconds - (now - wall0) : 10);
+		if(event->event_id == MPV_EVENT_PLAYBACK_RESTART && !playing){
+			playing = true;
+			cpu0 = get_cpu_seconds();
+			wall0 = get_wall_seconds();
+		} else if(event->event_id == MPV_EVENT_END_FILE ||
+				event->event_id == MPV_EVENT_SHUTDOWN){
+			if(!playing)
+				ok = false;
+			break;
+		}
+	}
+	double cpu = get_cpu_seconds() - cpu0;
+	double wall = get_wall_seconds() - wall0;
+	mpv_terminate_destroy(mpv);
+	if(!ok){
+		fprintf(stderr, "Playback didn't start\n");
+		return false;
+	}
+	printf("%-10s %7.2f s CPU in %6.1f s = %7.1f s CPU per hour of playback\n",
+			options[0] ? "options" : "none", cpu, wall, cpu / wall * 3600);
+	if(options[0])
+		printf("           (%s)\n", options);
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	if(argc < 2){
+		fprintf(stderr, "Usage: %s <file> [seconds (default: 60)] [ao (default: auto)]\n",
+				argv[0]);
+		return 1;
+	}
+	const char *path = argv[1];
+	double seconds = argc >= 3 ? atof(argv[2]) : 60;
+	if(seconds <= 0)
+		seconds = 60;
+	const char *ao = argc >= 4 ? argv[3] : NULL;
+	MediaFileType type = classify_file_extension(path);
+	const char *options = media_type_mpv_file_options(type);
+	if(options[0] == 0)
+		printf("No file-local options for this file type; both runs are the same\n");
+	if(!measure(path, "", seconds, ao))
+		return 1;
+	if(!measure(path, options, seconds, ao))
+		return 1;
+	return 0;
+}
@@ -0,0 +1,5 @@
+#!/bin/sh
+# Builds the standalone benchmarks into bench/. Run from the repository root,
+# like build.sh.
+g++ -o bench/strfnd_alloc bench/strfnd_alloc.cpp --std=c++0x -O2 -Wall -Wno-unused-function
+g++ -o bench/audio_only_cpu bench/audio_only_cpu.cpp src/media_types.cpp `pkg-config --libs --cflags mpv` --std=c++0x -O2 -Wall -Wno-unused-function
@@ -0,0 +1,111 @@
+// Counts heap allocations per parsed message for the copying Strfnd and the
+// non-owning StrfndRef, using the same steps as the Arduino serial and stdin
+// command handlers. See build.sh.
+#include "../src/types.hpp"
+#include "../src/string_util.hpp"
+#include "../src/command_accumulator.hpp"
+#include <chrono>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+
+static size_t num_allocations = 0;
+
+void* operator new(size_t size)
+{
+	num_allocations++;
+	void *p = malloc(size ? size : 1);
+	if(p == NULL)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+	free(p);
+}
+
+struct SampleMessage
+{
+	const char *text;
+	const char *separator; // ":" for Arduino messages, " " for stdin commands
+};
+
+static const SampleMessage SAMPLE_MESSAGES[] = {
+	{"<KEY_PRESS:12", ":"},
+	{"<KEY_RELEASE:12", ":"},
+	{"<MODE:RASPBERRY", ":"},
+	{"<CAPS:TRACK,SCROLL,PROGRESS,EXTRA_SEGMENTS", ":"},
+	{"<VERSION:4a7097141e9a52341e53cbb39646ad79", ":"},
+	{"random_album_approx_num_tracks 12", " "},
+};
+
+static const int NUM_ROUNDS = 100000;
+
+// Keeps the compiler from dropping the parsing
+static volatile size_t sink = 0;
+
+static void parse_strfnd(CommandAccumulator<100> &accu, const char *separator)
+{
+	ss_ message = accu.command();
+	Strfnd f(message);
+	ss_ first = f.next(separator);
+	if(first == "<CAPS"){
+		Strfnd caps_f(f.next(""));
+		while(!caps_f.atend())
+			sink += caps_f.next(",").size();
+	} else {
+		sink += stoi(f.next(separator), 0);
+	}
+	sink += first.size();
+}
+
+static void parse_strfnd_ref(CommandAccumulator<100> &accu, const char *separator)
+{
+	StrRef message(accu.buffer, accu.next_i);
+	StrfndRef f(message);
+	StrRef first = f.next(separator);
+	if(first == "<CAPS"){
+		StrfndRef caps_f(f.next(""));
+		while(!caps_f.atend())
+			sink += caps_f.next(",").size();
+	} else {
+		sink += stoi(f.next(separator), 0);
+	}
+	sink += first.size();
+}
+
+template<typename F>
+static void run(const char *name, const SampleMessage &message, F parse)
+{
+	CommandAccumulator<100> accu;
+	size_t allocations = 0;
+	auto t0 = std::chrono::steady_clock::now();
+	for(int i=0; i<NUM_ROUNDS; i++){
+		for(const char *c = message.text; *c; c++)
+			accu.put_char(*c);
+		accu.put_char('\n');
+		size_t before = num_allocations;
+		parse(accu, message.separator);
+		allocations += num_allocations - before;
+	}
+	auto t1 = std::chrono::steady_clock::now();
+	double ns = std::chrono::duration<double, std::nano>(t1 - t0).count();
+	printf("  %-10s %6.2f allocations/message %8.1f ns/message\n", name,
+			(double)allocations / NUM_ROUNDS, ns / NUM_ROUNDS);
+}
+
+int main()
+{
+	for(const SampleMessage &message : SAMPLE_MESSAGES){
+		printf("%s\n", message.text);
+		run("Strfnd", message, parse_strfnd);
+		run("StrfndRef", message, parse_strfnd_ref);
+	}
+	return 0;
+}
@@ -1,2 +1,2 @@
 #!/bin/sh
-g++ -o opts src/main.cpp src/c55_getopt.cpp src/file_watch.cpp src/filesys.cpp src/arduino_firmware.cpp src/arduino_global.cpp src/media_scan.cpp src/mpv_control.cpp src/mkdir_p.cpp src/ui_output_queue.cpp `pkg-config --libs --cflags mpv` --std=c++0x -Wall -Wno-unused-function -g
+g++ -o opts src/main.cpp src/c55_getopt.cpp src/file_watch.cpp src/filesys.cpp src/arduino_firmware.cpp src/arduino_global.cpp src/media_scan.cpp src/mpv_control.cpp src/mkdir_p.cpp src/ui_output_queue.cpp src/log_queue.cpp src/media_types.cpp src/play_history.cpp src/metadata.cpp src/prefetch.cpp src/transcode_cache.cpp src/uevent.cpp `pkg-config --libs --cflags mpv` --std=c++0x -pthread -Wall -Wno-unused-function -g
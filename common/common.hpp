@@ -7,3 +7,6 @@
 #define DISPLAY_FLAG_ALBUM 4
 #define DISPLAY_FLAG_PAUSE 5
 
+
+// Size of the firmware's serial command buffer; longer commands are dropped
+#define FIRMWARE_COMMAND_BUFFER_SIZE 128
@@ -1,10 +1,14 @@
 #pragma once
 #include "types.hpp"
+#include "print.hpp"
+#include "../common/common.hpp"
 #include <unistd.h>
 
 extern int arduino_serial_fd;
 extern ss_ arduino_serial_debug_mode;
 extern int arduino_display_width;
+extern set_<ss_> arduino_firmware_caps;
+extern ss_ arduino_last_scroll_command;
 
 static ss_ truncate(const ss_ &s, size_t len)
 {
@@ -103,15 +107,15 @@ static ss_ squeeze(const ss_ &s0, size_t len, size_t startpos=0, size_t try_len=
 static void arduino_serial_write(const char *data, size_t len)
 {
 	if(arduino_serial_debug_mode == "raw" && data != NULL && len != 0){
-		printf("%s", cs(ss_(data, len)));
+		printf_("%s", cs(ss_(data, len)));
 	}
 	if(arduino_serial_fd != -1){
 		int r = write(arduino_serial_fd, data, len);
 		if(r == -1){
-			printf("Arduino write error\n");
+			printf_("Arduino write error\n");
 			arduino_serial_fd = -1;
 		} else if((size_t)r != len){
-			printf("WARNING: Arduino serial didn't take the entire message\n");
+			printf_("WARNING: Arduino serial didn't take the entire message\n");
 			// TODO: Maybe handle this properly
 		}
 	}
@@ -124,13 +128,15 @@ static void arduino_serial_write(const ss_ &data)
 
 static void arduino_set_text(const ss_ &text)
 {
+	arduino_last_scroll_command.clear();
+
 	char buf[30];
 	int l = snprintf(buf, 30, ">SET_TEXT:%s\r\n",
 			cs(truncate(text, arduino_display_width)));
 	arduino_serial_write(buf, l);
 
 	if(arduino_serial_debug_mode == "fancy"){
-		printf("[%s]\n", cs(truncate(text, arduino_display_width)));
+		printf_("[%s]\n", cs(truncate(text, arduino_display_width)));
 	}
 }
 
@@ -143,8 +149,48 @@ static void arduino_set_temp_text(const ss_ &text)
 	arduino_serial_write(buf, l);
 
 	if(arduino_serial_debug_mode == "fancy"){
-		printf("[[%s]]\n", cs(truncate(text, arduino_display_width)));
+		printf_("[[%s]]\n", cs(truncate(text, arduino_display_width)));
+	}
+}
+
+// Hands all pieces to the firmware, which shows them one after another
+// followed by a separator, and keeps repeating that. Requires the SCROLL_TEXT
+// capability. Pieces that don't fit in the firmware's command buffer are left
+// out. Returns false if the same text was already being scrolled.
+static bool arduino_scroll_text(const sv_<ss_> &pieces, int first_piece_ms, int piece_ms)
+{
+	ss_ command = ">SCROLL_TEXT:"+itos(first_piece_ms)+":"+itos(piece_ms)+":";
+	for(size_t i=0; i<pieces.size(); i++){
+		ss_ piece = truncate(pieces[i], arduino_display_width);
+		for(char &c : piece){
+			if(c == '\t')
+				c = ' ';
+		}
+		// Leave room for "\t", "\r\n" and the terminating null
+		if(command.size() + 1 + piece.size() + 3 > FIRMWARE_COMMAND_BUFFER_SIZE)
+			break;
+		if(i != 0)
+			command += "\t";
+		command += piece;
 	}
+	command += "\r\n";
+	if(command == arduino_last_scroll_command)
+		return false;
+	arduino_last_scroll_command = command;
+	arduino_serial_write(command);
+
+	if(arduino_serial_debug_mode == "fancy"){
+		printf_("[");
+		for(size_t i=0; i<pieces.size(); i++)
+			printf_("%s%s", i == 0 ? "" : "|", cs(truncate(pieces[i], arduino_display_width)));
+		printf_("] (scrolling)\n");
+	}
+	return true;
+}
+
+static void arduino_request_caps()
+{
+	arduino_serial_write(">CAPS\r\n");
 }
 
 static void arduino_request_version()
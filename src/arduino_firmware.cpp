@@ -1,18 +1,131 @@
 #include "arduino_firmware.hpp"
+#include "arduino_global.hpp"
 #include "string_util.hpp"
 #include "arduino_controls.hpp"
+#include "ui_output_queue.hpp"
+#include "monotonic_time.hpp"
 #include "stuff2.hpp"
+#include "print.hpp"
 #include <fstream>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
 #ifdef __WIN32__
 #  include <time.h>
 #  include <windows.h>
-static void sleep(int s) { Sleep(s * 1000); }
-static void usleep(int us) { Sleep(us / 1000); }
+#  include <thread>
+#  include <atomic>
 #  include "Shlwapi.h"
 #  define strcasestr StrStrI
+#else
+#  include <sys/types.h>
+#  include <sys/wait.h>
+#  include <signal.h>
+#  include <unistd.h>
 #endif
 
+// The update runs in the background of the main loop so that playback
+// control stays responsive. avrdude owns the serial port while flashing, so
+// the port is closed for that time.
+enum FirmwareUpdateState {
+	FWU_IDLE,
+	FWU_STARTING, // "FW UP" is being shown before the port is handed over
+	FWU_FLASHING, // avrdude is running
+	FWU_REBOOT_WAIT, // Waiting for the arduino to boot the new firmware
+	FWU_VERIFY, // Waiting for <VERSION from the new firmware
+};
+
+static const int FWU_STARTING_MS = 100;
+static const int FWU_FLASH_TIMEOUT_MS = 120000;
+static const int FWU_REBOOT_WAIT_MS = 2000;
+static const int FWU_VERIFY_TIMEOUT_MS = 15000;
+static const int FWU_VERSION_REQUEST_INTERVAL_MS = 2000;
+static const int FWU_PROGRESS_INTERVAL_MS = 5000;
+
+static FirmwareUpdateState fwu_state = FWU_IDLE;
+static int64_t fwu_state_timestamp = 0;
+static int64_t fwu_last_progress_timestamp = 0;
+static int64_t fwu_last_version_request_timestamp = 0;
+static ss_ fwu_old_version;
+static ss_ fwu_new_version;
+
+#ifdef __WIN32__
+static std::thread avrdude_thread;
+static std::atomic<bool> avrdude_done(false);
+static std::atomic<int> avrdude_status(-1);
+#else
+static pid_t avrdude_pid = -1;
+#endif
+
+static bool start_avrdude(const ss_ &command)
+{
+#ifdef __WIN32__
+	avrdude_done = false;
+	avrdude_thread = std::thread([command](){
+		avrdude_status = system(command.c_str());
+		avrdude_done = true;
+	});
+	return true;
+#else
+	avrdude_pid = fork();
+	if(avrdude_pid == -1){
+		printf_("fork() failed: %s\n", strerror(errno));
+		return false;
+	}
+	if(avrdude_pid == 0){
+		execl("/bin/sh", "sh", "-c", command.c_str(), (char*)NULL);
+		_exit(127);
+	}
+	return true;
+#endif
+}
+
+// Returns true and the exit status once avrdude has exited
+static bool poll_avrdude(int &status)
+{
+#ifdef __WIN32__
+	if(!avrdude_done)
+		return false;
+	avrdude_thread.join();
+	status = avrdude_status;
+	return true;
+#else
+	int wstatus = 0;
+	pid_t r = waitpid(avrdude_pid, &wstatus, WNOHANG);
+	if(r == 0)
+		return false;
+	avrdude_pid = -1;
+	status = (r == -1 || !WIFEXITED(wstatus)) ? -1 : WEXITSTATUS(wstatus);
+	return true;
+#endif
+}
+
+static void kill_avrdude()
+{
+#ifdef __WIN32__
+	// system() can't be interrupted; let it finish on its own
+	avrdude_thread.detach();
+#else
+	kill(avrdude_pid, SIGKILL);
+	waitpid(avrdude_pid, NULL, 0);
+	avrdude_pid = -1;
+#endif
+}
+
+static void set_fwu_state(FirmwareUpdateState state)
+{
+	fwu_state = state;
+	fwu_state_timestamp = get_monotonic_ms();
+}
+
+static void fail_update(const char *short_text, const ss_ &reason)
+{
+	printf_("%s\n", cs(reason));
+	printf_("Not updating firmware from version %s\n", cs(fwu_old_version));
+	ui_output_queue::push_message(short_text, "", ui_output_queue::MP_HIGH);
+	set_fwu_state(FWU_IDLE);
+}
+
 void arduino_firmware_update_if_needed(const ss_ &current_version)
 {
 	// NOTE: current_version is the md5 hash of arduino/src/sketch.ino.
@@ -25,14 +138,15 @@ void arduino_firmware_update_if_needed(const ss_ &current_version)
 	// 'avrdude -c arduino -p atmega328p -P<arduino_serial_fd_path> -b57600
 	//     -V -U flash:w:arduino/.build_ano/nano/firmware.hex'
 
+	if(fwu_state != FWU_IDLE)
+		return;
+	fwu_old_version = current_version;
+
 	ss_ version_h_path = "arduino/version.h";
 	ss_ version_h_data;
 	bool ok = read_file_content(version_h_path, version_h_data);
 	if(!ok){
-		printf("Can't read %s\n", cs(version_h_path));
-		printf("Not updating firmware from version %s\n", cs(current_version));
-		arduino_set_text("FWUFAIL1");
-		usleep(3000000);
+		fail_update("FWUFAIL1", "Can't read "+version_h_path);
 		return;
 	}
 
@@ -40,47 +154,127 @@ void arduino_firmware_update_if_needed(const ss_ &current_version)
 	version_h_data_f.next("\"");
 	ss_ version_h_version = version_h_data_f.next("\"");
 	if(version_h_version.size() != 32){
-		printf("version.h version length is not 32 (\"%s\")\n", cs(version_h_version));
-		printf("Not updating firmware from version %s\n", cs(current_version));
-		arduino_set_text("FWUFAIL2");
-		usleep(3000000);
+		fail_update("FWUFAIL2", "version.h version length is not 32 (\""+
+				version_h_version+"\")");
 		return;
 	}
 
 	if(version_h_version == current_version){
-		printf("Arduino version is up to date at %s.\n", cs(current_version));
+		printf_("Arduino version is up to date at %s.\n", cs(current_version));
 		return;
 	}
 
-	printf("Updating arduino firmware from %s to %s\n",
+	printf_("Updating arduino firmware from %s to %s\n",
 			cs(current_version), cs(version_h_version));
+	fwu_new_version = version_h_version;
 
 	// Set this text so that the LCD will be showing it while the firmware is
 	// being uploaded and arduino reboots
 	arduino_set_temp_text("FW UP");
-	usleep(100000);
-
-	ss_ command = "avrdude -c arduino -p atmega328p -P"+arduino_serial_fd_path+
-			" -b57600 -V -U flash:w:arduino/.build_ano/nano/firmware.hex"+
-			" -q -l avrdude.log";
-	int r = system(command.c_str());
-	if(r != 0){
-		printf("Failed to execute avrdude.\n");
-		printf("Not updating firmware from version %s\n", cs(current_version));
-		arduino_set_text("FWUFAIL3");
-		usleep(3000000);
-	} else {
-		printf("Arduino firmware updated from %s to %s\n",
-				cs(current_version), cs(version_h_version));
-		// NOTE: Can't show anything on the display right away, so we sleep
-		// first for bit and hope the arduino has booted up during that time.
-		usleep(2000000);
-		arduino_set_text("FWU OK");
-		usleep(2000000);
-		arduino_set_text("FWU OK");
-		usleep(2000000);
-		arduino_set_text("FWU OK");
-		arduino_set_temp_text("FWU OK");
+	set_fwu_state(FWU_STARTING);
+}
+
+void arduino_firmware_handle_version(const ss_ &version)
+{
+	if(fwu_state != FWU_VERIFY)
+		return;
+	if(version != fwu_new_version){
+		fail_update("FWUFAIL4", "Arduino reports version "+version+
+				" instead of "+fwu_new_version+" after update");
+		return;
 	}
+	printf_("Arduino firmware updated from %s to %s\n",
+			cs(fwu_old_version), cs(fwu_new_version));
+	arduino_set_temp_text("FWU OK");
+	ui_output_queue::push_message("FWU OK", "", ui_output_queue::MP_HIGH);
+	set_fwu_state(FWU_IDLE);
 }
 
+bool arduino_firmware_update_is_flashing()
+{
+	return fwu_state == FWU_FLASHING;
+}
+
+bool arduino_firmware_update_is_running()
+{
+	return fwu_state != FWU_IDLE;
+}
+
+void handle_arduino_firmware_update()
+{
+	if(fwu_state == FWU_IDLE)
+		return;
+	int64_t now = get_monotonic_ms();
+	int64_t state_age = now - fwu_state_timestamp;
+
+	switch(fwu_state){
+	case FWU_IDLE:
+		break;
+	case FWU_STARTING: {
+		if(state_age < FWU_STARTING_MS)
+			break;
+		if(arduino_serial_fd != -1){
+			close(arduino_serial_fd);
+			arduino_serial_fd = -1;
+		}
+		ss_ command = "avrdude -c arduino -p atmega328p -P"+arduino_serial_fd_path+
+				" -b57600 -V -U flash:w:arduino/.build_ano/nano/firmware.hex"+
+				" -q -l avrdude.log";
+		if(!start_avrdude(command)){
+			fail_update("FWUFAIL3", "Failed to execute avrdude.");
+			try_open_arduino_serial();
+			break;
+		}
+		set_fwu_state(FWU_FLASHING);
+		break; }
+	case FWU_FLASHING: {
+		int status = 0;
+		if(poll_avrdude(status)){
+			if(status != 0){
+				fail_update("FWUFAIL3", "avrdude failed with status "+itos(status)+
+						"; see avrdude.log");
+				try_open_arduino_serial();
+				break;
+			}
+			printf_("avrdude done; waiting for arduino to boot\n");
+			set_fwu_state(FWU_REBOOT_WAIT);
+			break;
+		}
+		if(state_age >= FWU_FLASH_TIMEOUT_MS){
+			kill_avrdude();
+			fail_update("FWUFAIL5", "avrdude timed out");
+			try_open_arduino_serial();
+			break;
+		}
+		if(now - fwu_last_progress_timestamp >= FWU_PROGRESS_INTERVAL_MS){
+			fwu_last_progress_timestamp = now;
+			printf_("Flashing arduino firmware... %is\n", (int)(state_age / 1000));
+		}
+		break; }
+	case FWU_REBOOT_WAIT:
+		// NOTE: Can't show anything on the display right away, so wait for a
+		// bit first and hope the arduino has booted up during that time.
+		if(state_age < FWU_REBOOT_WAIT_MS)
+			break;
+		if(arduino_serial_fd == -1)
+			try_open_arduino_serial();
+		fwu_last_version_request_timestamp = 0;
+		set_fwu_state(FWU_VERIFY);
+		break;
+	case FWU_VERIFY:
+		if(state_age >= FWU_VERIFY_TIMEOUT_MS){
+			fail_update("FWUFAIL4", "No version response after update");
+			break;
+		}
+		if(arduino_serial_fd == -1){
+			try_open_arduino_serial();
+			break;
+		}
+		if(now - fwu_last_version_request_timestamp >= FWU_VERSION_REQUEST_INTERVAL_MS){
+			fwu_last_version_request_timestamp = now;
+			arduino_set_temp_text("FWU "+itos(state_age / 1000));
+			arduino_request_version();
+		}
+		break;
+	}
+}
@@ -3,5 +3,13 @@
 
 extern ss_ arduino_serial_fd_path;
 
+// Starts updating the firmware in the background if current_version isn't
+// the one in arduino/version.h
 void arduino_firmware_update_if_needed(const ss_ &current_version);
-
+// Called with the version the firmware reports, to verify an update
+void arduino_firmware_handle_version(const ss_ &version);
+// avrdude owns the serial port while this is true
+bool arduino_firmware_update_is_flashing();
+bool arduino_firmware_update_is_running();
+// Advances a running update; called from the main loop
+void handle_arduino_firmware_update();
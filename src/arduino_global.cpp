@@ -13,6 +13,7 @@
 #include "mpv_control.hpp"
 #include "ui_output_queue.hpp"
 #include "stuff.hpp"
+#include "monotonic_time.hpp"
 #include "../common/common.hpp"
 #include <mpv/client.h>
 #ifdef __WIN32__
@@ -36,13 +37,21 @@ ss_ arduino_serial_fd_path;
 bool tried_to_update_arduino_firmware = false;
 time_t arduino_last_incoming_message_timestamp = 0;
 CommandAccumulator<100> arduino_message_accu;
+// Optional features reported by the firmware via <CAPS. Old firmware doesn't
+// respond, in which case the host does everything itself.
+set_<ss_> arduino_firmware_caps;
+ss_ arduino_last_scroll_command;
 set_<int> current_keys;
 
 StatefulInputMode stateful_input_mode = SIM_NONE;
 time_t stateful_input_mode_active_timestamp = 0;
 CommandAccumulator<10> stateful_input_accu;
 
-time_t display_update_timestamp = 0;
+// Monotonic; see get_monotonic_ms(). 0 means update as soon as possible.
+int64_t display_next_update_ms = 0;
+static const int DISPLAY_BLINK_MS = 500;
+// Set when something else was shown over the default display
+bool current_displayed_track_name_restart = true;
 
 void arduino_set_extra_segments()
 {
@@ -57,6 +66,7 @@ void arduino_set_extra_segments()
 		extra_segment_flags |= (1<<DISPLAY_FLAG_REPEAT) | (1<<DISPLAY_FLAG_REPEAT_ONE);
 		break;
 	case TPM_SHUFFLE_ALL:
+	case TPM_GLOBAL_SHUFFLE:
 		extra_segment_flags |= (1<<DISPLAY_FLAG_SHUFFLE);
 		break;
 	case TPM_SHUFFLE_TRACKS:
@@ -65,6 +75,7 @@ void arduino_set_extra_segments()
 	case TPM_SMART_TRACK_SHUFFLE:
 	case TPM_SMART_ALBUM_SHUFFLE:
 	case TPM_MR_SHUFFLE:
+	case TPM_WEIGHTED_SHUFFLE:
 		extra_segment_flags |= (1<<DISPLAY_FLAG_SHUFFLE) | (1<<DISPLAY_FLAG_REPEAT) |
 				(1<<DISPLAY_FLAG_REPEAT_ONE);
 		break;
@@ -172,6 +183,8 @@ void handle_key_release(int key)
 
 void try_open_arduino_serial()
 {
+	if(arduino_firmware_update_is_flashing())
+		return;
 #ifdef __WIN32__
 #else
 	for(const ss_ &arduino_serial_path : arduino_serial_paths){
@@ -186,6 +199,8 @@ void try_open_arduino_serial()
 			continue;
 		}
 		printf_("Opened arduino serial port %s\n", cs(arduino_serial_path));
+		arduino_firmware_caps.clear();
+		arduino_last_scroll_command.clear();
 		arduino_serial_fd_path = arduino_serial_path;
 		return;
 	}
@@ -196,6 +211,8 @@ void handle_hwcontrols()
 {
 	update_stateful_input();
 
+	handle_arduino_firmware_update();
+
 	if(arduino_serial_fd == -1){
 		static time_t last_retry_time = 0;
 		if(last_retry_time < time(0) - 5 && !arduino_serial_paths.empty()){
@@ -216,51 +233,68 @@ void handle_hwcontrols()
 	for(char c : serial_stuff){
 		if(arduino_message_accu.put_char(c)){
 			arduino_last_incoming_message_timestamp = time(0);
-			ss_ message = arduino_message_accu.command();
-			Strfnd f(message);
-			ss_ first = f.next(":");
+			StrRef message(arduino_message_accu.buffer, arduino_message_accu.next_i);
+			StrfndRef f(message);
+			StrRef first = f.next(":");
 			if(first == "<KEY_PRESS"){
-				int key = stoi(f.next(":"));
+				int key = stoi(f.next(":"), 0);
 				printf_("<KEY_PRESS  : %i\n", key);
 				handle_key_press(key);
 			} else if(first == "<KEY_RELEASE"){
-				int key = stoi(f.next(":"));
+				int key = stoi(f.next(":"), 0);
 				printf_("<KEY_RELEASE: %i\n", key);
 				handle_key_release(key);
 			} else if(first == "<BOOT"){
 				printf_("<BOOT\n");
+				// The firmware may have been changed and has forgotten its text
+				arduino_firmware_caps.clear();
+				arduino_last_scroll_command.clear();
+				arduino_request_caps();
 				arduino_set_extra_segments();
 				temp_display_album();
 				refresh_track();
 
 				arduino_request_version();
 			} else if(first == "<MODE"){
-				ss_ mode = f.next(":");
+				StrRef mode = f.next(":");
 				if(mode == "RASPBERRY"){
 					if(current_cursor.current_pause_mode == PM_UNFOCUS_PAUSE){
 						printf_("Leaving unfocus pause\n");
 						check_mpv_error(mpv_command_string(mpv, "pause"));
 						current_cursor.current_pause_mode = PM_PLAY;
+						invalidate_track_timing();
 					}
 				} else {
 					if(current_cursor.current_pause_mode == PM_PLAY){
 						printf_("Entering unfocus pause\n");
 						check_mpv_error(mpv_command_string(mpv, "pause"));
 						current_cursor.current_pause_mode = PM_UNFOCUS_PAUSE;
+						invalidate_track_timing();
 					}
 				}
+			} else if(first == "<CAPS"){
+				printf_("%.*s\n", (int)message.len, message.ptr);
+				StrfndRef caps_f(f.next(""));
+				while(!caps_f.atend())
+					arduino_firmware_caps.insert(caps_f.next(",").str());
+				// Switch the display over to what the firmware can do
+				current_displayed_track_name_restart = true;
+				display_next_update_ms = 0;
+				invalidate_track_timing();
 			} else if(first == "<POWERDOWN_WARNING"){
 				printf_("<POWERDOWN_WARNING\n");
 				save_stuff();
 			} else if(first == "<VERSION"){
-				printf_("%s\n", cs(message));
-				ss_ version = f.next("");
-				if(!tried_to_update_arduino_firmware){
+				printf_("%.*s\n", (int)message.len, message.ptr);
+				ss_ version = f.next("").str();
+				if(arduino_firmware_update_is_running()){
+					arduino_firmware_handle_version(version);
+				} else if(!tried_to_update_arduino_firmware){
 					tried_to_update_arduino_firmware = true;
 					arduino_firmware_update_if_needed(version);
 				}
 			} else {
-				printf_("%s (ignored)\n", cs(message));
+				printf_("%.*s (ignored)\n", (int)message.len, message.ptr);
 			}
 		}
 	}
@@ -281,12 +315,13 @@ void display_stateful_input()
 	for(size_t i=0; i<stateful_input_accu.next_i; i++){
 		current_input += stateful_input_accu.buffer[i];
 	}
+	bool blink_on = (get_monotonic_ms() / DISPLAY_BLINK_MS) % 2;
 	switch(stateful_input_mode){
 	case SIM_TRACK_NUMBER:
-		arduino_set_text(current_input + (time(0)%2?"_":" ") + " TRACK");
+		arduino_set_text(current_input + (blink_on?"_":" ") + " TRACK");
 		break;
 	case SIM_ALBUM_NUMBER:
-		arduino_set_text(current_input + (time(0)%2?"_":" ") + " ALBUM");
+		arduino_set_text(current_input + (blink_on?"_":" ") + " ALBUM");
 		break;
 	case SIM_NONE:
 	case SIM_NUM_MODES:
@@ -295,16 +330,51 @@ void display_stateful_input()
 	}
 }
 
+// Text pieces are cached so that alternating between a message and the track
+// name doesn't split and uppercase the same strings again and again
+static sm_<ss_, sp_<const sv_<ss_>>> display_pieces_cache;
+static const size_t DISPLAY_PIECES_CACHE_MAX_SIZE = 32;
+
+static sp_<const sv_<ss_>> get_display_pieces(const ss_ &text)
+{
+	auto it = display_pieces_cache.find(text);
+	if(it != display_pieces_cache.end())
+		return it->second;
+	if(display_pieces_cache.size() >= DISPLAY_PIECES_CACHE_MAX_SIZE)
+		display_pieces_cache.clear();
+	sp_<const sv_<ss_>> pieces(new sv_<ss_>(toupper(
+			split_string_to_clean_ui_pieces(text, arduino_display_width))));
+	display_pieces_cache[text] = pieces;
+	return pieces;
+}
+
+static void show_display_frame(const ss_ &text, int dwell_ms)
+{
+	arduino_set_text(text);
+	display_next_update_ms = get_monotonic_ms() + dwell_ms;
+}
+
+static const char *DISPLAY_SEPARATOR = " - - -  ";
+// Host and firmware clocks are only in sync to a few milliseconds
+static const int SCROLL_TIMING_MARGIN_MS = 50;
+
+// If true, text is sent once and the firmware pages through the pieces
+static bool firmware_can_scroll()
+{
+	return arduino_serial_fd != -1 && arduino_firmware_caps.count("SCROLL_TEXT");
+}
+
 ss_ current_displayed_track_name;
-sv_<ss_> current_displayed_track_name_pieces;
+sp_<const sv_<ss_>> current_displayed_track_name_pieces;
 size_t current_displayed_track_name_next_shown_piece = 0;
 
 void update_and_show_default_display()
 {
-	display_update_timestamp = time(0);
+	display_next_update_ms = get_monotonic_ms() + display_piece_ms;
 
 	if(stateful_input_mode != SIM_NONE){
 		display_stateful_input();
+		display_next_update_ms = get_monotonic_ms() + DISPLAY_BLINK_MS;
 		return;
 	}
 
@@ -325,80 +395,102 @@ void update_and_show_default_display()
 	}
 
 	ss_ track_name = get_track_name(current_media_content, current_cursor);
-	if(minimize_display_updates && track_name == current_displayed_track_name)
+	if(minimize_display_updates && track_name == current_displayed_track_name &&
+			!current_displayed_track_name_restart)
 		return;
-	if(track_name != current_displayed_track_name){
+	if(track_name != current_displayed_track_name || !current_displayed_track_name_pieces){
 		current_displayed_track_name = track_name;
-		current_displayed_track_name_pieces = toupper(split_string_to_clean_ui_pieces(
-				track_name, arduino_display_width));
+		current_displayed_track_name_pieces = get_display_pieces(track_name);
+		current_displayed_track_name_next_shown_piece = 0;
+	}
+	if(current_displayed_track_name_restart){
+		current_displayed_track_name_restart = false;
 		current_displayed_track_name_next_shown_piece = 0;
 	}
+	if(firmware_can_scroll()){
+		// Nothing is sent unless the text changed; this just checks for that
+		// every display_piece_ms
+		arduino_scroll_text(*current_displayed_track_name_pieces,
+				display_piece_ms, display_piece_ms);
+		return;
+	}
 	if(current_displayed_track_name_next_shown_piece >=
-			current_displayed_track_name_pieces.size()){
+			current_displayed_track_name_pieces->size()){
 		// Full track name shown. Get next one.
 		current_displayed_track_name_next_shown_piece = 0;
-		// Show separator
-		arduino_set_text(" - - -  ");
-		display_update_timestamp = time(0);
+		show_display_frame(DISPLAY_SEPARATOR, display_piece_ms / 2);
 		return; // Showing empty screen
 	}
-	ss_ text_to_show = current_displayed_track_name_pieces[
-			current_displayed_track_name_next_shown_piece];
+	show_display_frame((*current_displayed_track_name_pieces)[
+			current_displayed_track_name_next_shown_piece], display_piece_ms);
 	current_displayed_track_name_next_shown_piece++;
-	arduino_set_text(text_to_show);
-	display_update_timestamp = time(0);
 	return; // Showing message
 }
 
-ss_ current_output_message;
-sv_<ss_> current_output_message_pieces;
+uint32_t current_output_message_id = 0;
+sp_<const sv_<ss_>> current_output_message_pieces;
 size_t current_output_message_next_shown_piece = 0;
 
 void handle_display()
 {
-	if(display_update_timestamp > time(0) - 1)
+	if(get_monotonic_ms() < display_next_update_ms)
 		return;
 
 	// Loop to find a message to show
 	for(;;){
-		ui_output_queue::Message m = ui_output_queue::get_message();
-		if(m.short_text == "")
+		const ui_output_queue::Message *m = ui_output_queue::peek_message();
+		if(!m)
 			break; // No messages
-		if(m.short_text != current_output_message){
-			current_output_message = m.short_text;
-			current_output_message_pieces = toupper(split_string_to_clean_ui_pieces(
-					m.short_text, arduino_display_width));
+		if(m->id != current_output_message_id){
+			current_output_message_id = m->id;
+			current_output_message_pieces = get_display_pieces(m->short_text);
 			current_output_message_next_shown_piece = 0;
 		}
+		current_displayed_track_name_restart = true; // Restart default display
 		if(current_output_message_next_shown_piece >=
-				current_output_message_pieces.size()){
+				current_output_message_pieces->size()){
 			// Full message shown. Get next one.
-			current_output_message = "";
+			current_output_message_id = 0;
 			current_output_message_next_shown_piece = 0;
-			ui_output_queue::pop_message();
+			ui_output_queue::pop_message(m->id);
+			if(firmware_can_scroll())
+				continue; // The firmware already showed the separator
 			// But meanwhile, show an empty screen to separate messages
-			arduino_set_text(" - - -  ");
-			display_update_timestamp = time(0);
-			current_displayed_track_name = ""; // Restart default display
-			current_displayed_track_name_next_shown_piece = 0; // Restart default display
+			show_display_frame(DISPLAY_SEPARATOR, display_piece_ms / 2);
 			return; // Showing empty screen
 		}
-		ss_ text_to_show = current_output_message_pieces[
-				current_output_message_next_shown_piece];
+		// The first piece is shown longer so that a message is noticed
+		int first_piece_ms = display_piece_ms * 3 / 2;
+		if(firmware_can_scroll()){
+			const sv_<ss_> &pieces = *current_output_message_pieces;
+			// Resend even if identical, so that the firmware starts over
+			arduino_last_scroll_command.clear();
+			arduino_scroll_text(pieces, first_piece_ms, display_piece_ms);
+			current_output_message_next_shown_piece = pieces.size();
+			// Pop it once the firmware has gone through it and the separator,
+			// a bit early so that the firmware doesn't start it over
+			display_next_update_ms = get_monotonic_ms() + first_piece_ms +
+					(pieces.size() - 1) * display_piece_ms + display_piece_ms / 2 -
+					SCROLL_TIMING_MARGIN_MS;
+			return; // Showing message
+		}
+		int dwell_ms = current_output_message_next_shown_piece == 0 ?
+				first_piece_ms : display_piece_ms;
+		show_display_frame((*current_output_message_pieces)[
+				current_output_message_next_shown_piece], dwell_ms);
 		current_output_message_next_shown_piece++;
-		arduino_set_text(text_to_show);
-		if(current_output_message_next_shown_piece == 0)
-			display_update_timestamp = time(0) + 1; // Ensure that this is shown for more than 1s
-		else
-			display_update_timestamp = time(0);
-		current_displayed_track_name = ""; // Restart default display
-		current_displayed_track_name_next_shown_piece = 0; // Restart default display
 		return; // Showing message
 	}
 
 	update_and_show_default_display();
 }
 
+int64_t display_ms_until_next_update()
+{
+	int64_t ms = display_next_update_ms - get_monotonic_ms();
+	return ms < 0 ? 0 : ms;
+}
+
 void stateful_input_mode_select()
 {
 	if(stateful_input_mode < SIM_NUM_MODES - 1)
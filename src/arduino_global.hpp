@@ -1,4 +1,5 @@
 #pragma once
+#include <stdint.h>
 
 enum StatefulInputMode {
 	SIM_NONE,
@@ -10,7 +11,7 @@ enum StatefulInputMode {
 
 extern int arduino_serial_fd;
 
-extern time_t display_update_timestamp;
+extern int64_t display_next_update_ms;
 
 void arduino_set_extra_segments();
 void handle_key_press(int key);
@@ -20,6 +21,7 @@ void handle_hwcontrols();
 void display_stateful_input();
 void update_and_show_default_display();
 void handle_display();
+int64_t display_ms_until_next_update();
 void stateful_input_mode_select();
 void stateful_input_mode_input(char input_char);
 void stateful_input_enter();
@@ -1,6 +1,7 @@
 // http://www.apache.org/licenses/LICENSE-2.0
 // Copyright 2014 Perttu Ahola <celeron55@gmail.com>
 #include "file_watch.hpp"
+#include "print.hpp"
 //#include "core/log.h"
 #include <cstring>
 #include <sys/inotify.h>
@@ -8,12 +9,13 @@
 #include <linux/limits.h> // PATH_MAX
 #define MODULE "__filewatch"
 
-#define log_w(module_name, fmt, ...) printf(#module_name ": " fmt, __VA_ARGS__)
+#define log_w(module_name, fmt, ...) printf_(#module_name ": " fmt "\n", __VA_ARGS__)
 #define log_v(...) ;
 #define log_d(...) ;
 #define log_t(...) ;
 
-#define INOTIFY_BUFSIZE (sizeof(struct inotify_event) + NAME_MAX + 1)
+// Holds a few hundred events; all queued events are normally read at once
+#define INOTIFY_BUFSIZE (64 * 1024)
 #define INOTIFY_STRUCTSIZE (sizeof(struct inotify_event))
 
 struct CFileWatch: FileWatch
@@ -29,6 +31,10 @@ struct CFileWatch: FileWatch
 	uint32_t mask;
 	int m_fd = -1;
 	sm_<int, sp_<WatchThing>> m_watch;
+	// Reused for every event so that dispatching doesn't allocate
+	char m_buf[INOTIFY_BUFSIZE]
+			__attribute__((aligned(__alignof__(struct inotify_event))));
+	ss_ m_event_path;
 
 	CFileWatch(uint32_t mask):
 		mask(mask)
@@ -76,9 +82,9 @@ struct CFileWatch: FileWatch
 	{
 		if(fd != m_fd)
 			return;
-		char buf[INOTIFY_BUFSIZE];
+		bool overflowed = false;
 		for(;;){
-			int r = read(fd, buf, INOTIFY_BUFSIZE);
+			ssize_t r = read(fd, m_buf, INOTIFY_BUFSIZE);
 			if(r == -1){
 				if(errno == EAGAIN)
 					break;
@@ -86,65 +92,77 @@ struct CFileWatch: FileWatch
 						"on fd=%i: %s", fd, strerror(errno));
 				break;
 			}
-			if(r < (int)INOTIFY_STRUCTSIZE){
+			if(r < (ssize_t)INOTIFY_STRUCTSIZE){
 				throw Exception("CFileWatch::report_fd(): read() -> "+itos(r));
 			}
-			struct inotify_event *in_event = (struct inotify_event*)buf;
-			ss_ name;
-			if(r >= (int)INOTIFY_STRUCTSIZE)
-				name = &buf[INOTIFY_STRUCTSIZE]; // Null-terminated string
-			ss_ mask_s;
-			if(in_event->mask & IN_ACCESS) mask_s += "IN_ACCESS | ";
-			if(in_event->mask & IN_ATTRIB) mask_s += "IN_ATTRIB | ";
-			if(in_event->mask & IN_CLOSE_WRITE) mask_s += "IN_CLOSE_WRITE | ";
-			if(in_event->mask & IN_CLOSE_NOWRITE) mask_s += "IN_CLOSE_NOWRITE | ";
-			if(in_event->mask & IN_CREATE) mask_s += "IN_CREATE | ";
-			if(in_event->mask & IN_DELETE) mask_s += "IN_DELETE | ";
-			if(in_event->mask & IN_DELETE_SELF) mask_s += "IN_DELETE_SELF | ";
-			if(in_event->mask & IN_MODIFY) mask_s += "IN_MODIFY | ";
-			if(in_event->mask & IN_MOVE_SELF) mask_s += "IN_MOVE_SELF | ";
-			if(in_event->mask & IN_MOVED_FROM) mask_s += "IN_MOVED_FROM | ";
-			if(in_event->mask & IN_MOVED_TO) mask_s += "IN_MOVED_TO | ";
-			if(in_event->mask & IN_OPEN) mask_s += "IN_OPEN | ";
-			if(in_event->mask & IN_IGNORED) mask_s += "IN_IGNORED | ";
-			if(in_event->mask & IN_ISDIR) mask_s += "IN_ISDIR | ";
-			if(in_event->mask & IN_Q_OVERFLOW) mask_s += "IN_Q_OVERFLOW | ";
-			if(in_event->mask & IN_UNMOUNT) mask_s += "IN_UNMOUNT | ";
+			for(ssize_t pos = 0; pos + (ssize_t)INOTIFY_STRUCTSIZE <= r; ){
+				struct inotify_event *in_event = (struct inotify_event*)&m_buf[pos];
+				pos += INOTIFY_STRUCTSIZE + in_event->len;
+				if(in_event->mask & IN_Q_OVERFLOW){
+					overflowed = true;
+					continue;
+				}
+				handle_event(in_event);
+			}
+		}
+		if(overflowed)
+			resync_all();
+	}
 
-			mask_s = mask_s.substr(0, mask_s.size()-3);
+	void handle_event(const struct inotify_event *in_event)
+	{
+		// name is null-padded to len
+		const char *name = in_event->len != 0 ? in_event->name : "";
 
-			log_d(MODULE, "in_event->wd=%i, mask=%s, name=%s",
-					in_event->wd, cs(mask_s), cs(name));
+		log_d(MODULE, "in_event->wd=%i, mask=0x%x, name=%s",
+				in_event->wd, in_event->mask, name);
 
-			auto it = m_watch.find(in_event->wd);
-			if(it == m_watch.end())
-				throw Exception("inotify returned unknown wd");
-			sp_<WatchThing> thing = it->second;
-			for(auto &cb : thing->cbs){
-				if(!name.empty())
-					cb(thing->path+"/"+name);
-				else
-					cb(thing->path);
-			};
+		auto it = m_watch.find(in_event->wd);
+		if(it == m_watch.end()){
+			// Can be left in the queue for a watch that was just removed
+			return;
+		}
+		// Kept alive over callbacks that may add or remove watches
+		sp_<WatchThing> thing = it->second;
+		m_event_path.assign(thing->path);
+		if(name[0] != 0){
+			m_event_path += '/';
+			m_event_path += name;
+		}
+		for(auto &cb : thing->cbs)
+			cb(m_event_path);
 
-			if(in_event->mask & IN_IGNORED){
-				// Inotify removed path from watch
-				const ss_ &path = thing->path;
-				m_watch.erase(in_event->wd);
-				int r = inotify_add_watch(m_fd, path.c_str(), mask);
-				if(r == -1){
-					log_w(MODULE, "inotify_add_watch() failed: %s (while trying "
-							"to re-watch ignored path \"%s\")",
-							strerror(errno), cs(path));
-				} else {
-					log_v(MODULE, "Re-watching auto-ignored path \"%s\" (inotify fd=%i)",
-							cs(path), m_fd);
-					m_watch[r] = thing;
-				}
+		if(in_event->mask & IN_IGNORED){
+			// Inotify removed path from watch
+			const ss_ &path = thing->path;
+			m_watch.erase(in_event->wd);
+			int r = inotify_add_watch(m_fd, path.c_str(), mask);
+			if(r == -1){
+				log_w(MODULE, "inotify_add_watch() failed: %s (while trying "
+						"to re-watch ignored path \"%s\")",
+						strerror(errno), cs(path));
+			} else {
+				log_v(MODULE, "Re-watching auto-ignored path \"%s\" (inotify fd=%i)",
+						cs(path), m_fd);
+				m_watch[r] = thing;
 			}
 		}
 	}
 
+	// Events were dropped by the kernel; report every watched path as changed
+	// so that users rescan whatever they watch
+	void resync_all()
+	{
+		log_w(MODULE, "inotify queue overflowed on fd=%i; resyncing", m_fd);
+		sv_<sp_<WatchThing>> things;
+		for(auto &pair : m_watch)
+			things.push_back(pair.second);
+		for(auto &thing : things){
+			for(auto &cb : thing->cbs)
+				cb(thing->path);
+		}
+	}
+
 	// Used on Windows; no-op on Linux
 	void update()
 	{
@@ -21,7 +21,8 @@ struct FileWatch
 	virtual void update() = 0;
 };
 
-// cb is called at either report_fd() or update().
+// cb is called at either report_fd() or update(). If events were lost (eg.
+// inotify's queue overflowed), cb is called with the watched path itself.
 FileWatch* createFileWatch(uint32_t mask);
 
 // Mask examples:
@@ -1,6 +1,12 @@
 #include "filesys.hpp"
 #include <stdio.h>
 #include <string.h>
+#ifdef DIR_LISTER_GETDENTS
+#  include <fcntl.h>
+#  include <unistd.h>
+#  include <sys/stat.h>
+#  include <sys/syscall.h>
+#endif
 
 /* "image.png", "png" -> true */
 bool check_file_extension(const char *path, const char *ext)
@@ -41,13 +47,24 @@ void strip_filename(char *path)
 	path[i] = 0;
 }
 
+bool DirLister::get_next(int *type, char *name, unsigned int maxlen)
+{
+	const char *name1;
+	if(!get_next(type, &name1))
+		return false;
+	snprintf(name, maxlen, "%s", name1);
+	return true;
+}
+
 #ifdef __WIN32__
 
-DirLister::DirLister(const char *path)
+DirLister::DirLister(const char *path, const DirLister *parent,
+		sv_<char> *shared_buffer):
+	path(parent ? parent->path + "/" + path : ss_(path))
 {
-	ss_ pattern = ss_() + path + "/*";
+	ss_ pattern = this->path + "/*";
 	if((hFind = FindFirstFile(pattern.c_str(), &FindFileData)) == INVALID_HANDLE_VALUE)
-		printf("ERROR: Failed to open path %s\n", path);
+		printf("ERROR: Failed to open path %s\n", cs(this->path));
 }
 
 DirLister::~DirLister()
@@ -56,7 +73,7 @@ DirLister::~DirLister()
 		FindClose(hFind);
 }
 
-bool DirLister::get_next(int *type, char *name, unsigned int maxlen)
+bool DirLister::get_next(int *type, const char **name)
 {
 	if(hFind == INVALID_HANDLE_VALUE)
 		return false;
@@ -65,7 +82,8 @@ bool DirLister::get_next(int *type, char *name, unsigned int maxlen)
 		*type = FS_DIR;
 	else
 		*type = FS_FILE;
-	snprintf(name, maxlen, FindFileData.cFileName);
+	snprintf(current_name, sizeof current_name, "%s", FindFileData.cFileName);
+	*name = current_name;
 
 	if(!FindNextFile(hFind, &FindFileData)){
 		FindClose(hFind);
@@ -79,11 +97,79 @@ bool DirLister::valid()
 	return hFind != INVALID_HANDLE_VALUE;
 }
 
-#else // __WIN32__
+#elif defined(DIR_LISTER_GETDENTS)
+
+struct linux_dirent64
+{
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+// Fits a few hundred entries; a directory is read in as few calls as possible
+static const size_t DIR_LISTER_BUFFER_SIZE = 32 * 1024;
+
+DirLister::DirLister(const char *path, const DirLister *parent,
+		sv_<char> *shared_buffer):
+	buffer(shared_buffer ? shared_buffer : &own_buffer)
+{
+	int dirfd = parent ? parent->fd : AT_FDCWD;
+	if(parent && dirfd == -1)
+		return;
+	fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(fd != -1 && buffer->size() < DIR_LISTER_BUFFER_SIZE)
+		buffer->resize(DIR_LISTER_BUFFER_SIZE);
+}
+
+DirLister::~DirLister()
+{
+	if(fd != -1) close(fd);
+}
+
+bool DirLister::get_next(int *type, const char **name)
+{
+	if(fd == -1) return false;
+	for(;;){
+		if(buffer_pos >= buffer_len){
+			long r = syscall(SYS_getdents64, fd, buffer->data(), buffer->size());
+			if(r <= 0)
+				return false;
+			buffer_len = r;
+			buffer_pos = 0;
+		}
+		struct linux_dirent64 *dp =
+				(struct linux_dirent64*)(buffer->data() + buffer_pos);
+		buffer_pos += dp->d_reclen;
+		unsigned char d_type = dp->d_type;
+		if(d_type == DT_UNKNOWN){
+			// Not all filesystems fill in d_type
+			struct stat st;
+			if(fstatat(fd, dp->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+				continue;
+			d_type = S_ISREG(st.st_mode) ? DT_REG : S_ISDIR(st.st_mode) ? DT_DIR : DT_LNK;
+		}
+		if(d_type == DT_REG) *type = FS_FILE;
+		else if(d_type == DT_DIR) *type = FS_DIR;
+		else *type = FS_OTHER;
+		*name = dp->d_name;
+		return true;
+	}
+}
 
-DirLister::DirLister(const char *path)
+bool DirLister::valid()
 {
-	dir = opendir(path);
+	return fd != -1;
+}
+
+#else
+
+DirLister::DirLister(const char *path, const DirLister *parent,
+		sv_<char> *shared_buffer):
+	path(parent ? parent->path + "/" + path : ss_(path))
+{
+	dir = opendir(this->path.c_str());
 }
 
 DirLister::~DirLister()
@@ -91,12 +177,12 @@ DirLister::~DirLister()
 	if(dir != NULL) closedir(dir);
 }
 
-bool DirLister::get_next(int *type, char *name, unsigned int maxlen)
+bool DirLister::get_next(int *type, const char **name)
 {
 	if(dir == NULL) return false;
 	struct dirent *dp = readdir(dir);
 	if(dp == NULL) return false;
-	snprintf(name, maxlen, "%s", dp->d_name);
+	*name = dp->d_name;
 	if(dp->d_type == DT_REG) *type = FS_FILE;
 	else if(dp->d_type == DT_DIR) *type = FS_DIR;
 	else *type = FS_OTHER;
@@ -109,4 +195,3 @@ bool DirLister::valid()
 }
 
 #endif // __WIN32__
-
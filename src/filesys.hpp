@@ -17,19 +17,43 @@ bool check_file_extension(const char *path, const char *ext);
 void strip_file_extension(char *path);
 void strip_filename(char *path);
 
+#if defined(__linux__)
+// Entries are read in bulk with getdents64() and subdirectories are opened
+// relative to their parent's fd
+#  define DIR_LISTER_GETDENTS
+#endif
+
 struct DirLister
 {
 #ifdef __WIN32__
 	HANDLE hFind;
 	WIN32_FIND_DATA FindFileData;
+	ss_ path;
+	char current_name[MAX_PATH_LEN];
+#elif defined(DIR_LISTER_GETDENTS)
+	int fd = -1;
+	sv_<char> own_buffer;
+	sv_<char> *buffer;
+	size_t buffer_len = 0;
+	size_t buffer_pos = 0;
 #else
 	DIR *dir = nullptr;
+	ss_ path;
 #endif
 
-	DirLister(const char *path);
+	// If parent is set, path is the name of a directory in it. Listing into
+	// a shared buffer avoids an allocation per directory; only one lister
+	// can be read at a time then.
+	DirLister(const char *path, const DirLister *parent=NULL,
+			sv_<char> *shared_buffer=NULL);
 	~DirLister();
 
 	bool valid();
 	bool get_next(int *type, char *name, unsigned int maxlen);
-};
+	// name points to memory owned by the lister; valid until the next call
+	bool get_next(int *type, const char **name);
 
+private:
+	DirLister(const DirLister&) = delete;
+	DirLister& operator=(const DirLister&) = delete;
+};
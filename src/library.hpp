@@ -1,45 +1,320 @@
 #pragma once
 #include "stuff2.hpp"
+#include "play_history.hpp"
+#include "metadata.hpp"
+#include "media_types.hpp"
 
 struct Track
 {
 	ss_ path;
 	ss_ display_name;
+	int track_number = -1; // From tags; -1 = unknown
+	// natural_sort_key() of the path relative to the album's directory
+	ss_ sort_key;
+	// Selects the mpv options the file is loaded with
+	MediaFileType media_type = MFT_AUDIO;
 
-	Track(const ss_ &path="", const ss_ &display_name=""):
-		path(path), display_name(display_name)
+	Track(const ss_ &path="", const ss_ &display_name="", const ss_ &sort_key=""):
+		path(path), display_name(display_name), sort_key(sort_key)
 	{}
 	bool operator < (const Track &other){
+		if(sort_key != other.sort_key)
+			return sort_key < other.sort_key;
 		return (path < other.path);
 	}
 };
 
+// Tracks are identified in the play history by their file name without the
+// extension; unlike display_name, it doesn't change when tag titles arrive
+static ss_ get_track_history_name(const Track &track)
+{
+	size_t begin = track.path.rfind('/');
+	begin = begin == ss_::npos ? 0 : begin + 1;
+	size_t end = track.path.rfind('.');
+	if(end == ss_::npos || end < begin)
+		end = track.path.size();
+	return track.path.substr(begin, end - begin);
+}
+
 struct Album
 {
 	ss_ name;
 	sv_<Track> tracks;
-	mutable sv_<size_t> shuffled_track_order;
 	bool shuffle_tracks_in_smart_mode = false;
+};
 
-	void ensure_shuffled_track_order_exists() const {
-		if(shuffled_track_order.size() != tracks.size())
-			create_shuffled_order(shuffled_track_order, tracks.size());
-	}
+// A top-level directory of the media. Directories of the same name on
+// several media paths are merged into one part.
+struct CollectionPart
+{
+	ss_ name;
+	sv_<std::pair<size_t, size_t>> album_ranges; // [begin, end) in Library::albums
+};
+
+// Everything found on the media. Scanned once and shared by all collection
+// parts. Immutable once published; changes are made to a copy which then
+// replaces it. Albums are shared between copies.
+struct Library
+{
+	sv_<sp_<const Album>> albums;
+	sv_<CollectionPart> parts; // Sorted by name
+	sm_<ss_, std::pair<size_t, size_t>> track_indices_by_path; // Album, track
+	bool scan_complete = true; // false while albums are still being found
+};
+
+// The albums of a Library that are in use
+struct AlbumView
+{
+	sp_<const Library> library;
+	sv_<size_t> indices; // Into library->albums
+
+	struct iterator {
+		const AlbumView *view;
+		size_t i;
+		const Album& operator*() const { return (*view)[i]; }
+		const Album* operator->() const { return &(*view)[i]; }
+		iterator& operator++(){ i++; return *this; }
+		bool operator!=(const iterator &other) const { return i != other.i; }
+	};
+
+	size_t size() const { return indices.size(); }
+	bool empty() const { return indices.empty(); }
+	const Album& operator[](size_t i) const { return *library->albums[indices[i]]; }
+	iterator begin() const { return iterator{this, 0}; }
+	iterator end() const { return iterator{this, indices.size()}; }
+	void clear(){ indices.clear(); }
+};
+
+// Albums sorted by a size, so that a random album within a size range can be
+// picked without going through all of them
+struct AlbumSizeIndex
+{
+	sv_<std::pair<double, size_t>> entries; // Size, index into albums
+	bool valid = false;
+};
+
+// The uniformly shuffled and the play history weighted track orders are kept
+// separately so that switching between the modes switches the order
+enum TrackOrderKind {
+	TOK_SHUFFLED,
+	TOK_WEIGHTED,
+	TOK_NUM_KINDS,
 };
 
 struct MediaContent
 {
-	sv_<Album> albums;
-	mutable sv_<size_t> shuffled_album_order;
-	mutable sv_<size_t> mr_shuffled_album_order;
+	AlbumView albums;
+	mutable sv_<u32> shuffled_album_order;
+	mutable sv_<u32> mr_shuffled_album_order;
+	mutable sv_<u32> weighted_album_order;
+	// Track orders of all albums in one pool per kind, each at the album's
+	// offset in track_count_prefix. Cleared when the albums are reshuffled; a
+	// pool is allocated when it's first used and the order of an album is
+	// filled in when it is first needed.
+	mutable sv_<u32> track_order_pools[TOK_NUM_KINDS];
+	mutable sv_<u8> track_order_created[TOK_NUM_KINDS]; // Per album
+	// Created when needed; the duration index is invalidated whenever new
+	// metadata arrives
+	mutable AlbumSizeIndex albums_by_num_tracks;
+	mutable AlbumSizeIndex albums_by_minutes;
+	// Number of tracks before each album, plus the total at the end; created
+	// when needed
+	mutable sv_<size_t> track_count_prefix;
+	// Saved with the play cursor so that the global shuffle order stays the
+	// same over restarts as long as the library doesn't change
+	u64 global_shuffle_key = 1;
+	mutable KeyedPermutation global_track_order;
 };
 
+static void index_track_paths(Library &library)
+{
+	library.track_indices_by_path.clear();
+	for(size_t ai=0; ai<library.albums.size(); ai++){
+		const Album &album = *library.albums[ai];
+		for(size_t ti=0; ti<album.tracks.size(); ti++)
+			library.track_indices_by_path[album.tracks[ti].path] = std::make_pair(ai, ti);
+	}
+}
+
+static const CollectionPart* find_collection_part(const Library &library,
+		const ss_ &name)
+{
+	for(const CollectionPart &part : library.parts){
+		if(part.name == name)
+			return &part;
+	}
+	return NULL;
+}
+
+static const sv_<size_t>& get_track_count_prefix(const MediaContent &mc)
+{
+	sv_<size_t> &prefix = mc.track_count_prefix;
+	if(prefix.size() == mc.albums.size() + 1)
+		return prefix;
+	prefix.resize(mc.albums.size() + 1);
+	prefix[0] = 0;
+	for(size_t i=0; i<mc.albums.size(); i++)
+		prefix[i+1] = prefix[i] + mc.albums[i].tracks.size();
+	return prefix;
+}
+
 static size_t get_total_tracks(const MediaContent &mc)
 {
-	size_t total = 0;
-	for(auto &a : mc.albums)
-		total += a.tracks.size();
-	return total;
+	return get_track_count_prefix(mc).back();
+}
+
+// Global track indices number all tracks of mc.albums in order
+static size_t get_global_track_index(const MediaContent &mc, size_t album_i,
+		size_t track_i)
+{
+	return get_track_count_prefix(mc)[album_i] + track_i;
+}
+
+static void split_global_track_index(const MediaContent &mc, size_t global_i,
+		size_t &album_i, size_t &track_i)
+{
+	const sv_<size_t> &prefix = get_track_count_prefix(mc);
+	// The last album starting at or before global_i; this skips empty albums
+	album_i = std::upper_bound(prefix.begin(), prefix.end(), global_i) -
+			prefix.begin() - 1;
+	track_i = global_i - prefix[album_i];
+}
+
+static const KeyedPermutation& get_global_track_order(const MediaContent &mc)
+{
+	size_t n = get_total_tracks(mc);
+	if(mc.global_track_order.n != n || mc.global_track_order.key != mc.global_shuffle_key)
+		mc.global_track_order.init(n, mc.global_shuffle_key);
+	return mc.global_track_order;
+}
+
+static void clear_track_orders(const MediaContent &mc)
+{
+	for(int kind=0; kind<TOK_NUM_KINDS; kind++){
+		mc.track_order_pools[kind].clear();
+		mc.track_order_created[kind].clear();
+	}
+}
+
+static u32* get_track_order_slot(const MediaContent &mc, TrackOrderKind kind,
+		size_t album_i)
+{
+	sv_<u32> &pool = mc.track_order_pools[kind];
+	sv_<u8> &created = mc.track_order_created[kind];
+	if(created.size() != mc.albums.size() || pool.size() != get_total_tracks(mc)){
+		pool.assign(get_total_tracks(mc), 0);
+		created.assign(mc.albums.size(), false);
+	}
+	return pool.data() + get_track_count_prefix(mc)[album_i];
+}
+
+// NULL if the album's order hasn't been created yet
+static const u32* find_track_order(const MediaContent &mc, TrackOrderKind kind,
+		size_t album_i)
+{
+	const sv_<u8> &created = mc.track_order_created[kind];
+	if(album_i >= created.size() || !created[album_i])
+		return NULL;
+	return get_track_order_slot(mc, kind, album_i);
+}
+
+// order must have as many entries as the album has tracks
+static void set_track_order(const MediaContent &mc, TrackOrderKind kind,
+		size_t album_i, const u32 *order)
+{
+	u32 *slot = get_track_order_slot(mc, kind, album_i);
+	std::copy(order, order + mc.albums[album_i].tracks.size(), slot);
+	mc.track_order_created[kind][album_i] = true;
+}
+
+static const u32* get_shuffled_track_order(const MediaContent &mc, size_t album_i)
+{
+	u32 *order = get_track_order_slot(mc, TOK_SHUFFLED, album_i);
+	if(!mc.track_order_created[TOK_SHUFFLED][album_i]){
+		create_shuffled_order(order, mc.albums[album_i].tracks.size());
+		mc.track_order_created[TOK_SHUFFLED][album_i] = true;
+	}
+	return order;
+}
+
+// Tracks played less often come earlier
+static const u32* get_weighted_track_order(const MediaContent &mc, size_t album_i)
+{
+	u32 *order = get_track_order_slot(mc, TOK_WEIGHTED, album_i);
+	if(mc.track_order_created[TOK_WEIGHTED][album_i])
+		return order;
+	const Album &album = mc.albums[album_i];
+	sv_<double> weights;
+	weights.reserve(album.tracks.size());
+	for(auto &track : album.tracks){
+		weights.push_back(play_history_track_weight(current_play_history,
+				album.name, get_track_history_name(track)));
+	}
+	create_weighted_order(order, weights);
+	mc.track_order_created[TOK_WEIGHTED][album_i] = true;
+	return order;
+}
+
+// Tracks whose duration isn't known yet are estimated from the known ones.
+// Returns 0 if no durations are known.
+static double get_album_duration(const Album &album)
+{
+	double known_total = 0;
+	size_t num_known = 0;
+	for(auto &track : album.tracks){
+		TrackMetadata md;
+		if(metadata_cache::get(track.path, md) && md.duration > 0){
+			known_total += md.duration;
+			num_known++;
+		}
+	}
+	if(num_known == 0)
+		return 0;
+	return known_total / num_known * album.tracks.size();
+}
+
+static const AlbumSizeIndex& get_albums_by_num_tracks(const MediaContent &mc)
+{
+	AlbumSizeIndex &index = mc.albums_by_num_tracks;
+	if(index.valid && index.entries.size() == mc.albums.size())
+		return index;
+	index.entries.clear();
+	index.entries.reserve(mc.albums.size());
+	for(size_t i=0; i<mc.albums.size(); i++)
+		index.entries.push_back(std::make_pair((double)mc.albums[i].tracks.size(), i));
+	std::sort(index.entries.begin(), index.entries.end());
+	index.valid = true;
+	return index;
+}
+
+static const AlbumSizeIndex& get_albums_by_minutes(const MediaContent &mc)
+{
+	AlbumSizeIndex &index = mc.albums_by_minutes;
+	if(index.valid && index.entries.size() == mc.albums.size())
+		return index;
+	index.entries.clear();
+	index.entries.reserve(mc.albums.size());
+	for(size_t i=0; i<mc.albums.size(); i++)
+		index.entries.push_back(std::make_pair(get_album_duration(mc.albums[i]) / 60, i));
+	std::sort(index.entries.begin(), index.entries.end());
+	index.valid = true;
+	return index;
+}
+
+// Picks a uniformly random album whose size is within [min_size, max_size].
+// Returns the number of albums in the range; 0 if there are none.
+static size_t pick_random_album_by_size(const AlbumSizeIndex &index,
+		double min_size, double max_size, size_t &album_i)
+{
+	auto begin = std::lower_bound(index.entries.begin(), index.entries.end(),
+			std::make_pair(min_size, (size_t)0));
+	auto end = std::upper_bound(begin, index.entries.end(),
+			std::make_pair(max_size, SIZE_MAX));
+	size_t num = end - begin;
+	if(num == 0)
+		return 0;
+	album_i = begin[rand() % num].second;
+	return num;
 }
 
 static ss_ get_filename_from_path(const ss_ &path)
@@ -57,6 +332,8 @@ static ss_ get_filename_from_path(const ss_ &path)
 
 static int detect_track_number(const Track &track)
 {
+	if(track.track_number > 0)
+		return track.track_number;
 	ss_ filename = get_filename_from_path(track.path);
 	const char *p = filename.c_str();
 	for(;;){
@@ -69,38 +346,78 @@ static int detect_track_number(const Track &track)
 	}
 }
 
-static void smart_shuffle_scan_albums(MediaContent &mc)
+// Puts the tracks in tag track number order if every track has a distinct
+// one; otherwise (eg. multi-disc albums) they stay in file name order.
+// Returns false if nothing moved. new_track_is gets the new index of each
+// track.
+static bool sort_album_by_track_numbers(Album &album, sv_<u32> *new_track_is=NULL)
+{
+	set_<int> numbers;
+	for(auto &track : album.tracks){
+		if(track.track_number <= 0 || !numbers.insert(track.track_number).second)
+			return false;
+	}
+	sv_<u32> old_track_is(album.tracks.size());
+	for(size_t i=0; i<old_track_is.size(); i++)
+		old_track_is[i] = i;
+	std::sort(old_track_is.begin(), old_track_is.end(), [&](u32 a, u32 b){
+		return album.tracks[a].track_number < album.tracks[b].track_number;
+	});
+	bool moved = false;
+	for(size_t i=0; i<old_track_is.size(); i++){
+		if(old_track_is[i] != i){
+			moved = true;
+			break;
+		}
+	}
+	if(!moved)
+		return false;
+	sv_<Track> tracks;
+	tracks.reserve(album.tracks.size());
+	if(new_track_is)
+		new_track_is->resize(album.tracks.size());
+	for(size_t i=0; i<old_track_is.size(); i++){
+		tracks.push_back(std::move(album.tracks[old_track_is[i]]));
+		if(new_track_is)
+			(*new_track_is)[old_track_is[i]] = i;
+	}
+	album.tracks.swap(tracks);
+	return true;
+}
+
+static void smart_shuffle_scan_album(Album &album)
 {
 	// Determine bool shuffle_tracks_in_smart_mode based on whether the album has
 	// numbered tracks from 1 to something or not
-	for(auto &album : mc.albums){
-		sv_<int> track_numbers; // -1 = not detected
-		for(auto &track : album.tracks){
-			track_numbers.push_back(detect_track_number(track));
-		}
-		bool numbers_found = true;
-		for(int i=0; i<(int)track_numbers.size(); i++){
-			bool found = false;
-			for(int j=0; j<(int)track_numbers.size(); j++){
-				if(track_numbers[j] == i+1){
-					found = true;
-					break;
-				}
-			}
-			if(!found){
-				numbers_found = false;
+	sv_<int> track_numbers; // -1 = not detected
+	for(auto &track : album.tracks){
+		track_numbers.push_back(detect_track_number(track));
+	}
+	bool numbers_found = true;
+	for(int i=0; i<(int)track_numbers.size(); i++){
+		bool found = false;
+		for(int j=0; j<(int)track_numbers.size(); j++){
+			if(track_numbers[j] == i+1){
+				found = true;
 				break;
 			}
 		}
-		album.shuffle_tracks_in_smart_mode = !numbers_found;
+		if(!found){
+			numbers_found = false;
+			break;
+		}
 	}
+	album.shuffle_tracks_in_smart_mode = !numbers_found;
 }
 
 static void reshuffle_all_media(MediaContent &mc)
 {
+	mc.albums_by_num_tracks.valid = false;
+	mc.albums_by_minutes.valid = false;
+	mc.track_count_prefix.clear();
+
 	// Clear track orders
-	for(auto &album : mc.albums)
-		album.shuffled_track_order.clear();
+	clear_track_orders(mc);
 
 	// Create shuffled album order
 	mc.shuffled_album_order.clear();
@@ -110,8 +427,89 @@ static void reshuffle_all_media(MediaContent &mc)
 	mc.mr_shuffled_album_order.clear();
 	create_mr_shuffled_order(mc.mr_shuffled_album_order, mc.albums.size());
 
-	// Detect which albums are to be shuffled in smart shuffle mode
-	smart_shuffle_scan_albums(mc);
+	// Create weighted album order; albums played recently or often go last
+	sm_<u32, size_t> recent_album_ages =
+			play_history_recent_album_ages(current_play_history);
+	sv_<double> album_weights;
+	album_weights.reserve(mc.albums.size());
+	for(auto &album : mc.albums){
+		album_weights.push_back(play_history_album_weight(current_play_history,
+				recent_album_ages, album.name));
+	}
+	create_weighted_order(mc.weighted_album_order, album_weights);
+}
+
+// Puts the albums that were at old_to_new[i] in old_order first, in the same
+// order. The rest follow in the order they already had in order.
+static void remap_album_order(sv_<u32> &order, const sv_<u32> &old_order,
+		const sv_<u32> &old_to_new)
+{
+	sv_<u8> used(order.size());
+	sv_<u32> result;
+	result.reserve(order.size());
+	for(u32 old_i : old_order){
+		if(old_i >= old_to_new.size())
+			continue;
+		u32 i = old_to_new[old_i];
+		if(i >= used.size() || used[i])
+			continue;
+		used[i] = true;
+		result.push_back(i);
+	}
+	for(u32 i : order){
+		if(!used[i])
+			result.push_back(i);
+	}
+	order.swap(result);
+}
+
+// Carries the album orders of old_mc over to the freshly shuffled albums of
+// mc, matching albums by name, so that the album sequence doesn't change
+// under the listener when the library is replaced. New albums go last.
+static void keep_album_orders(MediaContent &mc, const sv_<ss_> &old_album_names,
+		const sv_<u32> &old_shuffled_order, const sv_<u32> &old_mr_shuffled_order,
+		const sv_<u32> &old_weighted_order)
+{
+	// Albums of the same name are matched in the order they are in
+	sm_<ss_, sv_<u32>> new_indices_by_name;
+	for(size_t i=mc.albums.size(); i-- > 0;)
+		new_indices_by_name[mc.albums[i].name].push_back(i);
+	sv_<u32> old_to_new(old_album_names.size(), (u32)-1);
+	for(size_t i=0; i<old_album_names.size(); i++){
+		auto it = new_indices_by_name.find(old_album_names[i]);
+		if(it == new_indices_by_name.end() || it->second.empty())
+			continue;
+		old_to_new[i] = it->second.back();
+		it->second.pop_back();
+	}
+	remap_album_order(mc.shuffled_album_order, old_shuffled_order, old_to_new);
+	remap_album_order(mc.mr_shuffled_album_order, old_mr_shuffled_order, old_to_new);
+	remap_album_order(mc.weighted_album_order, old_weighted_order, old_to_new);
+}
+
+// Selects the albums of a collection part, or all albums if part is "".
+// Returns false if there is no such part.
+static bool select_collection_part(MediaContent &mc, const sp_<const Library> &library,
+		const ss_ &part_name)
+{
+	mc.albums.library = library;
+	mc.albums.indices.clear();
+	if(part_name == ""){
+		mc.albums.indices.reserve(library->albums.size());
+		for(size_t i=0; i<library->albums.size(); i++)
+			mc.albums.indices.push_back(i);
+	} else {
+		const CollectionPart *part = find_collection_part(*library, part_name);
+		if(part == NULL)
+			return false;
+		for(auto &range : part->album_ranges){
+			for(size_t i=range.first; i<range.second; i++)
+				mc.albums.indices.push_back(i);
+		}
+	}
+	reshuffle_all_media(mc);
+	get_albums_by_num_tracks(mc);
+	return true;
 }
 
 extern MediaContent current_media_content;
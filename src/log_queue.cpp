@@ -0,0 +1,195 @@
+#include "log_queue.hpp"
+#include "monotonic_time.hpp"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace log_queue {
+
+// A message that doesn't fit in one slot is split over consecutive ones
+static const size_t SLOT_TEXT_SIZE = 112;
+static const size_t NUM_SLOTS = 1024; // Must be a power of two
+static const int WRITER_IDLE_WAIT_MS = 50;
+
+struct Slot
+{
+	// == position when free for a producer, position+1 when filled
+	std::atomic<size_t> seq;
+	int64_t timestamp_ms;
+	u32 len;
+	char text[SLOT_TEXT_SIZE];
+};
+
+static Slot slots[NUM_SLOTS];
+static std::atomic<size_t> enqueue_pos(0);
+static size_t dequeue_pos = 0; // Only touched by the writer thread
+static std::atomic<u32> num_dropped(0);
+static std::atomic<bool> running(false);
+static std::atomic<bool> writer_waiting(false);
+static std::atomic<bool> stop_requested(false);
+static std::mutex wait_mutex;
+static std::condition_variable wait_cv;
+static std::thread writer;
+static int64_t start_ms = 0;
+static bool at_line_start = true;
+
+static void append_text(ss_ &out, int64_t timestamp_ms, const char *text, size_t len)
+{
+	for(size_t i=0; i<len; i++){
+		if(at_line_start){
+			char prefix[32];
+			int64_t t = timestamp_ms - start_ms;
+			snprintf(prefix, sizeof prefix, "[%5" PRId64 ".%03d] ",
+					t / 1000, (int)(t % 1000));
+			out += prefix;
+			at_line_start = false;
+		}
+		out += text[i];
+		if(text[i] == '\n')
+			at_line_start = true;
+	}
+}
+
+// Returns false if nothing was queued
+static bool write_queued()
+{
+	ss_ out;
+	u32 dropped = num_dropped.exchange(0);
+	if(dropped != 0){
+		char buf[64];
+		snprintf(buf, sizeof buf, "%s[log: %u messages dropped]\n",
+				at_line_start ? "" : "\n", dropped);
+		append_text(out, get_monotonic_ms(), buf, strlen(buf));
+	}
+	for(;;){
+		Slot &slot = slots[dequeue_pos & (NUM_SLOTS - 1)];
+		if(slot.seq.load(std::memory_order_acquire) != dequeue_pos + 1)
+			break;
+		append_text(out, slot.timestamp_ms, slot.text, slot.len);
+		slot.seq.store(dequeue_pos + NUM_SLOTS, std::memory_order_release);
+		dequeue_pos++;
+	}
+	if(out.empty())
+		return false;
+	fwrite(out.c_str(), 1, out.size(), stdout);
+	fflush(stdout);
+	return true;
+}
+
+static void writer_main()
+{
+	for(;;){
+		if(write_queued())
+			continue;
+		if(stop_requested)
+			return;
+		std::unique_lock<std::mutex> lock(wait_mutex);
+		writer_waiting = true;
+		// Producers don't take the mutex, so a wakeup can be missed; the
+		// timeout bounds how late such a message is written
+		wait_cv.wait_for(lock, std::chrono::milliseconds(WRITER_IDLE_WAIT_MS));
+		writer_waiting = false;
+	}
+}
+
+static void enqueue(const char *text, size_t len)
+{
+	size_t num_needed = (len + SLOT_TEXT_SIZE - 1) / SLOT_TEXT_SIZE;
+	if(num_needed == 0)
+		return;
+	if(num_needed > NUM_SLOTS){
+		num_dropped++;
+		return;
+	}
+	// Reserve num_needed consecutive slots. The writer frees slots in order,
+	// so if the last one is free, all of them are.
+	size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+	for(;;){
+		size_t last = pos + num_needed - 1;
+		size_t seq = slots[last & (NUM_SLOTS - 1)].seq.load(std::memory_order_acquire);
+		if(seq == last){
+			if(enqueue_pos.compare_exchange_weak(pos, pos + num_needed,
+					std::memory_order_relaxed))
+				break;
+		} else if(seq < last){
+			// Full
+			num_dropped++;
+			return;
+		} else {
+			pos = enqueue_pos.load(std::memory_order_relaxed);
+		}
+	}
+	int64_t now = get_monotonic_ms();
+	for(size_t i=0; i<num_needed; i++){
+		Slot &slot = slots[(pos + i) & (NUM_SLOTS - 1)];
+		size_t offset = i * SLOT_TEXT_SIZE;
+		slot.len = len - offset < SLOT_TEXT_SIZE ? len - offset : SLOT_TEXT_SIZE;
+		memcpy(slot.text, text + offset, slot.len);
+		slot.timestamp_ms = now;
+		slot.seq.store(pos + i + 1, std::memory_order_release);
+	}
+	if(writer_waiting)
+		wait_cv.notify_one();
+}
+
+void start()
+{
+	if(writer.joinable())
+		return;
+	for(size_t i=0; i<NUM_SLOTS; i++)
+		slots[i].seq = i;
+	enqueue_pos = 0;
+	dequeue_pos = 0;
+	start_ms = get_monotonic_ms();
+	at_line_start = true;
+	stop_requested = false;
+	writer = std::thread(writer_main);
+	running = true;
+	static bool atexit_registered = false;
+	if(!atexit_registered){
+		atexit(stop);
+		atexit_registered = true;
+	}
+}
+
+void stop()
+{
+	if(!writer.joinable())
+		return;
+	// Anything logged by other threads after this is written synchronously
+	running = false;
+	stop_requested = true;
+	wait_cv.notify_one();
+	writer.join();
+}
+
+void printf(const char *fmt, ...)
+{
+	char buf[512];
+	va_list ap;
+	va_start(ap, fmt);
+	int len = vsnprintf(buf, sizeof buf, fmt, ap);
+	va_end(ap);
+	if(len < 0)
+		return;
+	ss_ long_text;
+	const char *text = buf;
+	if((size_t)len >= sizeof buf){
+		long_text.resize(len + 1);
+		va_start(ap, fmt);
+		vsnprintf(&long_text[0], len + 1, fmt, ap);
+		va_end(ap);
+		text = long_text.c_str();
+	}
+	if(!running){
+		fwrite(text, 1, len, stdout);
+		return;
+	}
+	enqueue(text, len);
+}
+
+}
@@ -0,0 +1,16 @@
+#pragma once
+#include "types.hpp"
+
+// Asynchronous stdout logger. printf_ formats into a lock-free ring buffer
+// and a background thread writes it out, so a slow stdout (eg. journald
+// under load) doesn't stall the main loop. Lines are prefixed with the time
+// since startup at which they were logged.
+namespace log_queue
+{
+	// Until start() and after stop(), output is written synchronously
+	void start();
+	// Writes out everything queued so far and stops the writer thread
+	void stop();
+	void printf(const char *fmt, ...)
+			__attribute__((format(printf, 1, 2)));
+}
@@ -15,8 +15,14 @@
 #include "print.hpp"
 #include "library.hpp"
 #include "play_cursor.hpp"
+#include "play_history.hpp"
+#include "metadata.hpp"
+#include "prefetch.hpp"
+#include "transcode_cache.hpp"
+#include "uevent.hpp"
 #include "arduino_global.hpp"
 #include "media_scan.hpp"
+#include "media_types.hpp"
 #include "mpv_control.hpp"
 #include "ui_output_queue.hpp"
 #include "../common/common.hpp"
@@ -39,6 +45,7 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <math.h> // HUGE_VAL
 
 ss_ config_path = "__default__";
 bool config_must_be_readable = false;
@@ -52,8 +59,10 @@ bool there_are_command_line_static_media_paths = false;
 ss_ arduino_serial_debug_mode = "off"; // off / raw / fancy
 int arduino_display_width = 8;
 bool minimize_display_updates = false;
+int display_piece_ms = 1000;
+bool use_tag_track_names = false;
 
-set_<ss_> enabled_log_sources;
+u32 enabled_log_sources = 0;
 
 time_t startup_timestamp = 0;
 
@@ -64,9 +73,10 @@ CommandAccumulator<100> stdin_command_accu;
 ss_ current_collection_part;
 
 bool queued_pause = false;
-sv_<size_t> queued_album_shuffled_track_order;
+sv_<u32> queued_album_shuffled_track_order;
 
 MediaContent current_media_content;
+PlayHistory current_play_history;
 
 TrackProgressMode track_progress_mode = TPM_NORMAL;
 PlayCursor current_cursor;
@@ -107,6 +117,7 @@ void save_stuff()
 	save_blob += itos(save_stream_pos) + ";";
 	save_blob += itos(last_succesfully_playing_cursor.current_pause_mode == PM_PAUSE) + ";";
 	save_blob += itos(last_succesfully_playing_cursor.track_progress_mode) + ";";
+	save_blob += std::to_string(current_media_content.global_shuffle_key) + ";";
 	save_blob += "\n";
 	save_blob += last_succesfully_playing_cursor.track_name + "\n";
 	save_blob += last_succesfully_playing_cursor.album_name + "\n";
@@ -114,10 +125,10 @@ void save_stuff()
 	// Save track order of current album
 	auto &cursor = current_cursor;
 	auto &mc = current_media_content;
-	if(cursor.album_i(mc) < (int)mc.albums.size()){
-		const Album &album = mc.albums[cursor.album_i(mc)];
-		for(size_t i : album.shuffled_track_order)
-			save_blob += itos(i) + ";";
+	if(const u32 *order = find_track_order(mc,
+			tpm_track_order_kind(cursor.track_progress_mode), cursor.album_i(mc))){
+		for(size_t i=0; i<mc.albums[cursor.album_i(mc)].tracks.size(); i++)
+			save_blob += itos(order[i]) + ";";
 	}
 	save_blob += "\n";
 
@@ -127,12 +138,21 @@ void save_stuff()
 	f<<save_blob;
 	f.close();
 
+	play_history_save(current_play_history, saved_state_path+".history");
+	metadata_cache::save(saved_state_path+".metadata");
+
 	if(LOG_DEBUG)
 		printf_("Saved.\n");
 }
 
 void load_stuff()
 {
+	if(play_history_load(current_play_history, saved_state_path+".history")){
+		if(LOG_DEBUG)
+			printf_("Loaded play history of %zu albums\n",
+					current_play_history.album_play_counts.size());
+	}
+
 	ss_ data;
 	{
 		std::ifstream f(saved_state_path.c_str());
@@ -144,27 +164,29 @@ void load_stuff()
 		data = ss_((std::istreambuf_iterator<char>(f)),
 				std::istreambuf_iterator<char>());
 	}
-	Strfnd f(data);
-	Strfnd f1(f.next("\n"));
+	StrfndRef f(data);
+	StrfndRef f1(f.next("\n"));
 	last_succesfully_playing_cursor.album_seq_i = stoi(f1.next(";"), 0);
 	last_succesfully_playing_cursor.track_seq_i = stoi(f1.next(";"), 0);
 	last_succesfully_playing_cursor.time_pos = stof(f1.next(";"), 0.0);
 	last_succesfully_playing_cursor.stream_pos = stoi(f1.next(";"), 0);
 	queued_pause = stoi(f1.next(";"), 0);
 	last_succesfully_playing_cursor.track_progress_mode = (TrackProgressMode)stoi(f1.next(";"), 0);
-	last_succesfully_playing_cursor.track_name = f.next("\n");
-	last_succesfully_playing_cursor.album_name = f.next("\n");
+	u64 global_shuffle_key = strtoull(f1.next(";").str().c_str(), NULL, 10);
+	if(global_shuffle_key != 0)
+		current_media_content.global_shuffle_key = global_shuffle_key;
+	last_succesfully_playing_cursor.track_name = f.next("\n").str();
+	last_succesfully_playing_cursor.album_name = f.next("\n").str();
 
 	// Load track order of current album
 	queued_album_shuffled_track_order.clear();
-	ss_ order_s = f.next("\n");
-	Strfnd order_f(order_s);
+	StrfndRef order_f(f.next("\n"));
 	while(!order_f.atend()){
 		int i = stoi(order_f.next(";"), 0);
 		queued_album_shuffled_track_order.push_back(i);
 	}
 
-	current_collection_part = f.next("\n");
+	current_collection_part = f.next("\n").str();
 
 	current_cursor = last_succesfully_playing_cursor;
 
@@ -193,6 +215,7 @@ void command_playpause()
 		check_mpv_error(mpv_command_string(mpv, "pause"));
 
 		current_cursor.current_pause_mode = was_pause ? PM_PLAY : PM_PAUSE; // Invert
+		invalidate_track_timing();
 
 		if(!was_pause){
 			ui_output_queue::push_message("PAUSE");
@@ -236,7 +259,7 @@ void command_prevalbum()
 void ui_flush_display()
 {
 	ui_output_queue::unprioritize_queue();
-	display_update_timestamp = 0;
+	display_next_update_ms = 0;
 }
 
 void change_track_progress_mode(TrackProgressMode track_progress_mode)
@@ -314,8 +337,7 @@ void command_album_number(int album_n)
 		return;
 	}
 
-	current_cursor.select_album_using_media_index(mc, album_media_index);
-	current_cursor.track_seq_i = 0;
+	current_cursor.select_album_start_using_media_index(mc, album_media_index);
 	start_at_relative_track(0, 0, true);
 }
 
@@ -384,7 +406,8 @@ void command_search(const ss_ &searchstring)
 				printf_("Not found\n");
 				return;
 			}
-			auto &track = album.tracks[cursor.track_i(mc)];
+			// Not necessarily on album in TPM_GLOBAL_SHUFFLE
+			auto &track = mc.albums[cursor.album_i(mc)].tracks[cursor.track_i(mc)];
 			//printf_("track.display_name: %s\n", cs(track.display_name));
 			if(strcasestr(track.display_name.c_str(), searchstring.c_str())){
 				printf_("Found track\n");
@@ -393,7 +416,7 @@ void command_search(const ss_ &searchstring)
 				return;
 			}
 			cursor.track_seq_i++;
-			if(cursor.track_seq_i >= (int)album.tracks.size())
+			if(cursor.track_seq_i >= cursor.seq_album_size(mc))
 				break;
 		}
 		cursor.track_seq_i = 0;
@@ -428,72 +451,48 @@ void command_random_album()
 	start_at_relative_track(0, 0, true);
 }
 
-void command_random_album_approx_num_tracks(size_t approx_num_tracks)
+// Returns false if there are no suitable albums
+static bool start_random_album_by_size(const AlbumSizeIndex &index,
+		double min_size, double max_size)
 {
-	auto &mc = current_media_content;
-	sv_<int> suitable_albums;
-	for(size_t i=0; i<mc.albums.size(); i++){
-		auto &album = mc.albums[i];
-		if(album.tracks.size() >= approx_num_tracks * 0.60 &&
-				album.tracks.size() <= approx_num_tracks * 1.6){
-			suitable_albums.push_back(i);
-		}
-	}
-	if(suitable_albums.empty()){
+	size_t album_i = 0;
+	size_t num_suitable = pick_random_album_by_size(index, min_size, max_size,
+			album_i);
+	if(num_suitable == 0){
 		printf_("No suitable albums\n");
-		return;
+		return false;
 	}
-	int album_seq_i = suitable_albums[rand() % suitable_albums.size()];
-	auto &album = mc.albums[album_seq_i];
-	printf_("Picking random album #%i (%zu tracks) from %zu suitable albums\n",
-			album_seq_i+1, album.tracks.size(), suitable_albums.size());
-	current_cursor.album_seq_i = album_seq_i;
-	current_cursor.track_seq_i = 0;
+	auto &album = current_media_content.albums[album_i];
+	printf_("Picking random album #%zu (%zu tracks, %.0f minutes) from %zu "
+			"suitable albums\n", album_i+1, album.tracks.size(),
+			get_album_duration(album) / 60, num_suitable);
+	current_cursor.select_album_start_using_media_index(current_media_content, album_i);
 	start_at_relative_track(0, 0, true);
+	return true;
+}
+
+void command_random_album_approx_num_tracks(size_t approx_num_tracks)
+{
+	start_random_album_by_size(get_albums_by_num_tracks(current_media_content),
+			approx_num_tracks * 0.60, approx_num_tracks * 1.6);
 }
 
 void command_random_album_min_num_tracks(size_t min_num_tracks)
 {
-	auto &mc = current_media_content;
-	sv_<int> suitable_albums;
-	for(size_t i=0; i<mc.albums.size(); i++){
-		auto &album = mc.albums[i];
-		if(album.tracks.size() >= min_num_tracks)
-			suitable_albums.push_back(i);
-	}
-	if(suitable_albums.empty()){
-		printf_("No suitable albums\n");
-		return;
-	}
-	int album_seq_i = suitable_albums[rand() % suitable_albums.size()];
-	auto &album = mc.albums[album_seq_i];
-	printf_("Picking random album #%i (%zu tracks) from %zu suitable albums\n",
-			album_seq_i+1, album.tracks.size(), suitable_albums.size());
-	current_cursor.album_seq_i = album_seq_i;
-	current_cursor.track_seq_i = 0;
-	start_at_relative_track(0, 0, true);
+	start_random_album_by_size(get_albums_by_num_tracks(current_media_content),
+			min_num_tracks, HUGE_VAL);
 }
 
 void command_random_album_max_num_tracks(size_t max_num_tracks)
 {
-	auto &mc = current_media_content;
-	sv_<int> suitable_albums;
-	for(size_t i=0; i<mc.albums.size(); i++){
-		auto &album = mc.albums[i];
-		if(album.tracks.size() <= max_num_tracks)
-			suitable_albums.push_back(i);
-	}
-	if(suitable_albums.empty()){
-		printf_("No suitable albums\n");
-		return;
-	}
-	int album_seq_i = suitable_albums[rand() % suitable_albums.size()];
-	auto &album = mc.albums[album_seq_i];
-	printf_("Picking random album #%i (%zu tracks) from %zu suitable albums\n",
-			album_seq_i+1, album.tracks.size(), suitable_albums.size());
-	current_cursor.album_seq_i = album_seq_i;
-	current_cursor.track_seq_i = 0;
-	start_at_relative_track(0, 0, true);
+	start_random_album_by_size(get_albums_by_num_tracks(current_media_content),
+			0, max_num_tracks);
+}
+
+void command_random_album_approx_duration(double approx_minutes)
+{
+	start_random_album_by_size(get_albums_by_minutes(current_media_content),
+			approx_minutes * 0.75, approx_minutes * 1.33);
 }
 
 void command_random_track()
@@ -502,8 +501,7 @@ void command_random_track()
 	auto &cursor = current_cursor;
 	if(cursor.album_seq_i < 0 || cursor.album_seq_i >= (int)mc.albums.size())
 		return;
-	auto &album = mc.albums[cursor.album_i(mc)];
-	int track_seq_i = rand() % album.tracks.size();
+	int track_seq_i = rand() % cursor.seq_album_size(mc);
 	printf_("Picking random track #%i\n", track_seq_i+1);
 	current_cursor.track_seq_i = track_seq_i;
 	start_at_relative_track(0, 0, false);
@@ -514,12 +512,12 @@ void handle_stdin()
 	ss_ stdin_stuff = read_any(0); // 0=stdin
 	for(char c : stdin_stuff){
 		if(stdin_command_accu.put_char(c)){
-			ss_ command = stdin_command_accu.command();
-			Strfnd f(command);
-			ss_ w1 = f.next(" ");
-			Strfnd fn(command);
+			StrRef command(stdin_command_accu.buffer, stdin_command_accu.next_i);
+			StrfndRef f(command);
+			StrRef w1 = f.next(" ");
+			StrfndRef fn(command);
 			fn.while_any("abcdefghijklmnopqrstuvwxyz");
-			ss_ w1n = command.substr(0, fn.where());
+			StrRef w1n = command.substr(0, fn.where());
 			fn.while_any(" ");
 			if(command == "help" || command == "h" || command == "?"){
 				printf_("Commands:\n");
@@ -540,6 +538,7 @@ void handle_stdin()
 				printf_("  randomalbum, ra, r <approx. #tracks (optional)>\n");
 				printf_("  rg, g <min. #tracks> (greater)\n");
 				printf_("  rl, l <max. #tracks> (lower)\n");
+				printf_("  rd <approx. minutes>\n");
 				printf_("  randomtrack, rt\n");
 				printf_("  albumlist, al, la\n");
 				printf_("  tracklist, tl, lt\n");
@@ -548,6 +547,7 @@ void handle_stdin()
 				printf_("  path (show path of current track)\n");
 				printf_("  np/pp/rp/lp/sp<n> (next/previous/reset/list/select collection part)\n");
 				printf_("  reshuffle\n");
+				printf_("  rescan\n");
 			} else if(command == "next" || command == "n" || command == "+"){
 				command_next();
 			} else if(command == "prev" || command == "p" || command == "-"){
@@ -579,7 +579,7 @@ void handle_stdin()
 				save_stuff();
 			} else if(command.size() >= 2 && (command.substr(0, 1) == "/" ||
 					command.substr(0, 1) == "1")){
-				ss_ searchstring = command.substr(1);
+				ss_ searchstring = command.substr(1).str();
 				command_search(searchstring);
 				last_searchstring = searchstring;
 			} else if(command == "/" || command == "1"){
@@ -617,6 +617,10 @@ void handle_stdin()
 					printf_("Using previous parameter: %i\n", last_max_num_tracks);
 					command_random_album_max_num_tracks(last_max_num_tracks);
 				}
+			} else if(w1n == "rd"){
+				int approx_minutes = stoi(fn.next(""), -1);
+				if(approx_minutes > 0)
+					command_random_album_approx_duration(approx_minutes);
 			} else if(w1 == "randomtrack" || w1 == "rt"){
 				command_random_track();
 			} else if(command == "albumlist" || command == "al" || command == "la"){
@@ -689,9 +693,12 @@ void handle_stdin()
 				}
 			} else if(w1n == "reshuffle"){
 				printf_("Reshuffling all media\n");
+				current_media_content.global_shuffle_key = create_random_key();
 				reshuffle_all_media(current_media_content);
+			} else if(w1n == "rescan"){
+				rescan_current_mount();
 			} else {
-				printf_("Invalid command: \"%s\"\n", cs(command));
+				printf_("Invalid command: \"%.*s\"\n", (int)command.len, command.ptr);
 			}
 		}
 	}
@@ -710,6 +717,27 @@ void handle_periodic_save()
 	save_stuff();
 }
 
+void handle_uevents()
+{
+	bool block_changed = false;
+	bool tty_added = false;
+	for(const uevent::Event &event : uevent::read_events()){
+		if(LOG_DEBUG)
+			printf_("uevent: %s %s %s\n", cs(event.action), cs(event.subsystem),
+					cs(event.devname));
+		if(event.subsystem == "block")
+			block_changed = true;
+		else if(event.subsystem == "tty" && event.action == "add")
+			tty_added = true;
+	}
+	if(block_changed && static_media_paths.empty()){
+		printf_("Partitions changed\n");
+		handle_changed_partitions();
+	}
+	if(tty_added && arduino_serial_fd == -1)
+		try_open_arduino_serial();
+}
+
 #ifdef __WIN32__
 BOOL WINAPI windowsConsoleCtrlHandler(DWORD signal)
 {
@@ -735,14 +763,23 @@ void do_intro()
 	printf_("⌁ OVER POWERED TRACK SWITCH ⌁\n");
 }
 
+static u32 log_source_from_name(const ss_ &name)
+{
+	if(name == "mpv")
+		return LOG_SOURCE_MPV;
+	if(name == "debug")
+		return LOG_SOURCE_DEBUG;
+	return 0;
+}
+
 // First call with command line arguments, then with config arguments
 int handle_args(int argc, char *argv[], const char *error_prefix, bool from_config)
 {
 	c55_argi = 0; // Reset c55_getopt
 	c55_cp = NULL; // Reset c55_getopt
 
-	const char opts[100] = "hC:s:d:S:m:D:UW:l:";
-	const char usagefmt[1000] =
+	const char opts[100] = "hC:s:d:S:m:D:UW:t:l:TP:AE:MX:Z:";
+	const char usagefmt[2000] =
 			"Usage: %s [OPTION]...\n"
 			"  -h                   Show this help\n"
 			"  -C [path]            Configuration file path (default: $HOME/.config/opts/opts)\n"
@@ -753,7 +790,15 @@ int handle_args(int argc, char *argv[], const char *error_prefix, bool from_conf
 			"  -D [mode]            Set arduino serial debug mode (off/raw/fancy)\n"
 			"  -U                   Minimize display updates\n"
 			"  -W [integer]         Set text display width\n"
+			"  -t [ms]              Time to show each piece of text on display (default: 1000)\n"
 			"  -l [string]          Enable log source (mpv/debug)\n"
+			"  -T                   Use title and track number tags instead of file names\n"
+			"  -P [MB]              Read this much of the next track ahead of time (default: 0)\n"
+			"  -A                   Only include audio files; skip video containers\n"
+			"  -E [ext1,ext2,...]   Also include files with these extensions\n"
+			"  -M                   Recognize files with an unknown extension by their content\n"
+			"  -X [path]            Transcode CPU-heavy files in the background into this cache directory\n"
+			"  -Z [MB]              Maximum size of the transcode cache (default: 1000)\n"
 			;
 
 	int c;
@@ -804,9 +849,47 @@ int handle_args(int argc, char *argv[], const char *error_prefix, bool from_conf
 		case 'W':
 			arduino_display_width = atoi(c55_optarg);
 			break;
-		case 'l':
-			enabled_log_sources.insert(c55_optarg);
+		case 't':
+			display_piece_ms = atoi(c55_optarg);
+			if(display_piece_ms < 100)
+				display_piece_ms = 100;
+			break;
+		case 'l': {
+			u32 source = log_source_from_name(c55_optarg);
+			if(source == 0)
+				printf_("Unknown log source: %s\n", c55_optarg);
+			enabled_log_sources |= source;
+			break; }
+		case 'T':
+			use_tag_track_names = true;
+			break;
+		case 'P': {
+			double mb = atof(c55_optarg);
+			prefetch::set_read_size(mb > 0 ? mb * 1024 * 1024 : 0);
+			break; }
+		case 'A':
+			media_type_config.audio_only = true;
+			break;
+		case 'E': {
+			Strfnd f(c55_optarg);
+			while(!f.atend()){
+				ss_ ext = f.next(",");
+				for(char &c : ext)
+					c = tolower(c);
+				if(ext != "")
+					media_type_config.extra_extensions.insert(ext);
+			}
+			break; }
+		case 'M':
+			media_type_config.sniff_content = true;
+			break;
+		case 'X':
+			transcode_cache::set_directory(c55_optarg);
 			break;
+		case 'Z': {
+			double mb = atof(c55_optarg);
+			transcode_cache::set_max_size(mb > 0 ? mb * 1024 * 1024 : 0);
+			break; }
 		default:
 			if(error_prefix)
 				fprintf_(stderr, "%s\n", error_prefix);
@@ -914,6 +997,11 @@ int main(int argc, char *argv[])
 #endif
 	startup_timestamp = time(0);
 	srand(time(0));
+	current_media_content.global_shuffle_key = create_random_key();
+
+#ifndef __WIN32__
+	log_queue::start();
+#endif
 
 	if(int r = handle_args(argc, argv, NULL, false) != 0){
 		return r;
@@ -955,8 +1043,16 @@ int main(int argc, char *argv[])
 
 	load_stuff();
 
+	metadata_cache::load(saved_state_path+".metadata");
+	metadata_cache::start();
+	prefetch::start();
+	transcode_cache::start();
+
 	try_open_arduino_serial();
 
+	if(!uevent::init())
+		printf_("uevents unavailable; polling for media changes\n");
+
 	create_file_watch();
 
     mpv = mpv_create();
@@ -989,14 +1085,31 @@ int main(int argc, char *argv[])
 
 		handle_mpv();
 
+		handle_uevents();
+
 		handle_mount();
 
+		handle_scan_results();
+
+		handle_metadata_updates();
+
 		handle_periodic_save();
 
-		usleep(1000000/60);
+		// Don't oversleep the next display frame
+		int64_t sleep_us = display_ms_until_next_update() * 1000;
+		usleep(sleep_us < 1000000/60 ? sleep_us : 1000000/60);
 	}
 
+	stop_scan();
+	prefetch::stop();
+	transcode_cache::stop();
+	metadata_cache::stop();
+	metadata_cache::save(saved_state_path+".metadata");
+
     mpv_terminate_destroy(mpv);
     close(arduino_serial_fd);
+#ifndef __WIN32__
+	log_queue::stop();
+#endif
     return 0;
 }
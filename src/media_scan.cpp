@@ -1,4 +1,5 @@
 #include "media_scan.hpp"
+#include "media_types.hpp"
 #include "stuff.hpp"
 #include "string_util.hpp"
 #include "file_watch.hpp"
@@ -10,11 +11,18 @@
 #include "library.hpp"
 #include "play_cursor.hpp"
 #include "mpv_control.hpp"
+#include "prefetch.hpp"
+#include "transcode_cache.hpp"
+#include "uevent.hpp"
+#include "ui_output_queue.hpp"
 #include "../common/common.hpp"
 #include "types.hpp"
 #include <mpv/client.h>
 #include <fstream>
 #include <algorithm> // sort
+#include <thread>
+#include <atomic>
+#include <chrono>
 #ifdef __WIN32__
 #  include "windows_includes.hpp"
 #else
@@ -31,43 +39,54 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 up_<FileWatch> partitions_watch;
 
 ss_ current_mount_device;
 ss_ current_mount_path;
 
+// Background scanning: the scan thread builds a new Library and publishes it
+// and the main loop swaps it in at handle_scan_results()
+static std::thread scan_thread;
+static std::atomic<bool> scan_cancel_requested(false);
+static std::atomic<bool> scan_in_progress(false);
+static sp_<const Library> published_library; // Only via std::atomic_*
+// True until the first library of the current media has been started from
+static bool waiting_for_first_library = true;
+
+// Only touched by the scan thread
+struct ScanState
+{
+	bool stream = false; // Publish partial libraries while scanning
+	sv_<CollectionPart> parts; // Unmerged, in the order they were found
+	sm_<ss_, std::pair<size_t, size_t>> track_indices_by_path;
+	size_t num_indexed_albums = 0;
+	size_t num_published_albums = 0;
+	std::chrono::steady_clock::time_point last_publish_time;
+};
+static ScanState scan_state;
+
+// Partial libraries are published this often while streaming
+static const int SCAN_PUBLISH_INTERVAL_MS = 500;
+
 bool filename_supported(const ss_ &name)
 {
-	// Not all of these are even actually supported but at least nothing
-	// ridiculous is included so that browsing random USB storage things is
-	// possible
-	static set_<ss_> supported_file_extensions = {
-		"3ga", "aac", "aif", "aifc", "aiff", "amr", "au", "aup", "caf", "flac",
-		"gsm", "iff", "kar", "m4a", "m4p", "m4r", "mid", "midi", "mmf", "mp2",
-		"mp3", "mpga", "ogg", "oma", "opus", "qcp", "ra", "ram", "wav", "wma",
-		"xspf", "3g2", "3gp", "3gpp", "asf", "avi", "divx", "f4v", "flv",
-		"h264", "ifo", "m2ts", "m4v", "mkv", "mov", "mp4", "mpeg", "mpg",
-		"mswmm", "mts", "mxf", "ogv", "rm", "swf", "ts", "vep", "vob", "webm",
-		"wlmp", "wmv", "aac", "cue", "d64", "flac", "m4a", "mp4", "s3m", "sfv",
-		"swf", "wav", "xd",
-		// These don't really work properly (playlists or unsupported formats)
-		//"m3u", "pls", "srt", "spc", "t64", "xm", "rar", "sid", "mid", "mod",
-		//"it"
-	};
-
-	// Check file extension
-	ss_ ext;
-	for(int i=name.size()-1; i>=0; i--){
-		if(name[i] == '.'){
-			ext = name.substr(i+1);
-			for(size_t i=0; i<ext.size(); i++)
-				ext[i] = tolower(ext[i]);
-			break;
-		}
-	}
-	return supported_file_extensions.count(ext);
+	return media_type_wanted(classify_file_extension(name.c_str()));
+}
+
+#ifndef __WIN32__
+static MediaFileType sniff_file(const ss_ &path)
+{
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if(fd == -1)
+		return MFT_NONE;
+	u8 buf[MEDIA_SNIFF_SIZE];
+	ssize_t r = read(fd, buf, sizeof buf);
+	close(fd);
+	return r > 0 ? sniff_media_type(buf, r) : MFT_NONE;
 }
+#endif
 
 static bool is_default_root_name(const ss_ &name)
 {
@@ -78,10 +97,35 @@ static bool is_default_root_name(const ss_ &name)
 	return false;
 }
 
-void scan_directory(const ss_ &root_name, const ss_ &path, sv_<Album> &result_albums,
-		Album *parent_dir_album)
+static void publish_scan_progress(const sv_<sp_<const Album>> &albums, bool complete);
+
+// Applies known tags and queues the rest to be probed
+static void finish_album(Album &album)
+{
+	for(Track &track : album.tracks){
+		TrackMetadata md;
+		if(metadata_cache::get(track.path, md))
+			apply_track_metadata(track, md);
+		metadata_cache::queue_probe(track.path);
+	}
+	sort_album_by_track_numbers(album);
+	// Detect whether the album is to be shuffled in smart shuffle mode
+	smart_shuffle_scan_album(album);
+}
+
+// parent_dl is the lister of the parent directory, if any; root_name is the
+// directory's name in it. dir_buffer is shared by the whole walk. A
+// collection part always gets an album of its own, even with one track.
+static void scan_directory(const ss_ &root_name, const ss_ &path,
+		const DirLister *parent_dl, sv_<char> &dir_buffer,
+		sv_<sp_<const Album>> &result_albums, Album *parent_dir_album,
+		sv_<CollectionPart> *subdir_parts, bool is_part)
 {
-	DirLister dl(path.c_str());
+	if(scan_cancel_requested)
+		return;
+
+	DirLister dl(parent_dl ? root_name.c_str() : path.c_str(), parent_dl,
+			&dir_buffer);
 
 	Album root_album;
 	if(root_name.size() <= 7 && parent_dir_album &&
@@ -91,90 +135,147 @@ void scan_directory(const ss_ &root_name, const ss_ &path, sv_<Album> &result_al
 		root_album.name = root_name;
 	}
 
-	sv_<ss_> subdirs;
+	sv_<std::pair<ss_, ss_>> subdirs; // Sort key, name
+	sv_<ss_> unknown_files;
 
 	for(;;){
 		int ftype;
-		char fname[PATH_MAX];
-		if(!dl.get_next(&ftype, fname, PATH_MAX))
+		const char *fname;
+		if(!dl.get_next(&ftype, &fname))
 			break;
 		if(fname[0] == '.')
 			continue;
 		if(ftype == FS_FILE){
-			if(!filename_supported(fname))
+			MediaFileType type = classify_file_extension(fname);
+			if(type == MFT_NONE && media_type_config.sniff_content){
+				// Looked into after listing so that the listing isn't interleaved
+				// with file reads
+				unknown_files.push_back(fname);
+				continue;
+			}
+			if(!media_type_wanted(type))
 				continue;
 			//printf_("File: %s\n", cs(path+"/"+fname));
-			char stripped[100];
-			snprintf(stripped, sizeof stripped, "%s", fname);
-			strip_file_extension(stripped);
-			root_album.tracks.push_back(Track(path+"/"+fname, stripped));
+			const char *dot = strrchr(fname, '.');
+			size_t display_name_len = dot ? dot - fname : strlen(fname);
+			root_album.tracks.push_back(Track(path+"/"+fname,
+					ss_(fname, display_name_len), natural_sort_key(fname, strlen(fname))));
+			root_album.tracks.back().media_type = type;
 		} else if(ftype == FS_DIR){
 			//printf_("Dir: %s\n", cs(path+"/"+fname));
-			subdirs.push_back(fname);
+			subdirs.push_back(std::make_pair(natural_sort_key(fname, strlen(fname)),
+					ss_(fname)));
 		}
 	}
 
+#ifndef __WIN32__
+	for(const ss_ &fname : unknown_files){
+		MediaFileType type = sniff_file(path+"/"+fname);
+		if(!media_type_wanted(type))
+			continue;
+		if(LOG_DEBUG)
+			printf_("Recognized %s by content\n", cs(path+"/"+fname));
+		size_t dot_i = fname.rfind('.');
+		root_album.tracks.push_back(Track(path+"/"+fname,
+				dot_i == ss_::npos ? fname : fname.substr(0, dot_i),
+				natural_sort_key(fname)));
+		root_album.tracks.back().media_type = type;
+	}
+#endif
+
 	// Sort subdirs
 	std::sort(subdirs.begin(), subdirs.end());
 
 	// Scan subdirs
-	for(const ss_ &fname : subdirs){
-		scan_directory(fname, path+"/"+fname, result_albums, &root_album);
+	for(auto &subdir : subdirs){
+		const ss_ &fname = subdir.second;
+		size_t albums_begin = result_albums.size();
+		bool subdir_is_part = subdir_parts && fname != "FW";
+		scan_directory(fname, path+"/"+fname, &dl, dir_buffer, result_albums,
+				&root_album, NULL, subdir_is_part);
+		if(subdir_is_part && result_albums.size() != albums_begin){
+			CollectionPart part;
+			part.name = fname;
+			part.album_ranges.push_back(std::make_pair(albums_begin,
+					result_albums.size()));
+			subdir_parts->push_back(part);
+		}
 	}
 
-	// Sort by path
+	// Natural order of the file names
 	std::sort(root_album.tracks.begin(), root_album.tracks.end());
 
-	if(!root_album.tracks.empty()){
-		if(parent_dir_album){
-			// If there is only one track, don't create a new album and instead
-			// just push the track to the parent directory album
-			if(root_album.tracks.size() == 1)
-				parent_dir_album->tracks.push_back(root_album.tracks[0]);
-			else
-				result_albums.push_back(root_album);
-		} else {
-			result_albums.push_back(root_album);
-		}
+	if(root_album.tracks.empty())
+		return;
+	// If there is only one track, don't create a new album and instead just
+	// push the track to the parent directory album
+	if(parent_dir_album && root_album.tracks.size() == 1 && !is_part){
+		Track &track = root_album.tracks[0];
+		track.sort_key = natural_sort_key(root_name) + "/" + track.sort_key;
+		parent_dir_album->tracks.push_back(track);
+		return;
 	}
+	finish_album(root_album);
+	result_albums.push_back(sp_<const Album>(new Album(std::move(root_album))));
+	publish_scan_progress(result_albums, false);
+}
+
+void scan_directory(const ss_ &root_name, const ss_ &path,
+		sv_<sp_<const Album>> &result_albums, Album *parent_dir_album,
+		sv_<CollectionPart> *subdir_parts)
+{
+	sv_<char> dir_buffer;
+	scan_directory(root_name, path, NULL, dir_buffer, result_albums,
+			parent_dir_album, subdir_parts, false);
 }
 
 sv_<ss_> get_collection_parts()
 {
-	sv_<ss_> media_paths;
+	sv_<ss_> names;
+	if(current_media_content.albums.library){
+		for(const CollectionPart &part : current_media_content.albums.library->parts)
+			names.push_back(part.name);
+	}
+	return names;
+}
 
-	if(!static_media_paths.empty()){
-		for(const ss_ &path : static_media_paths)
-			media_paths.push_back(path);
-	} else {
-		media_paths.push_back(current_mount_path);
+static void start_at_current_collection_part()
+{
+	auto &mc = current_media_content;
+	if(!mc.albums.library)
+		return;
+
+	if(!select_collection_part(mc, mc.albums.library, current_collection_part)){
+		printf_("Collection part \"%s\" doesn't exist; using all\n",
+				cs(current_collection_part));
+		current_collection_part = "";
+		select_collection_part(mc, mc.albums.library, current_collection_part);
 	}
 
-	sv_<ss_> subdirs;
+	current_cursor = last_succesfully_playing_cursor;
 
-	for(const ss_ &path : media_paths){
-		DirLister dl(path.c_str());
-		for(;;){
-			int ftype;
-			char fname[PATH_MAX];
-			if(!dl.get_next(&ftype, fname, PATH_MAX))
-				break;
-			if(ftype != FS_DIR)
-				continue;
-			if(fname[0] == '.')
-				continue;
-			if(ss_(fname) == "FW")
-				continue;
-			//printf_("Dir: %s\n", cs(path+"/"+fname));
-			subdirs.push_back(fname);
-			// TODO: Don't add duplicates
-		}
+	if(current_cursor.album_seq_i == 0 && current_cursor.track_seq_i == 0 &&
+			current_cursor.track_name == ""){
+		if(LOG_DEBUG)
+			printf_("Starting without saved state; picking random album\n");
+		command_random_album();
+		return;
 	}
 
-	// Sort subdirs
-	std::sort(subdirs.begin(), subdirs.end());
+	if(!static_media_paths.empty() && mc.albums.empty()){
+		// There are static media paths and there are no tracks; do nothing
+		printf_("No media.\n");
+		return;
+	}
 
-	return subdirs;
+	if(!force_resolve_track(mc, current_cursor)){
+		printf_("Force-resolve track failed; picking random album\n");
+		command_random_album();
+		return;
+	}
+
+	force_start_at_cursor();
+	ui_show_changed_album();
 }
 
 void set_collection_part(const ss_ &part)
@@ -188,80 +289,396 @@ void set_collection_part(const ss_ &part)
 		last_succesfully_playing_cursor = PlayCursor();
 	}
 
-	// Re-scan
-	scan_current_mount();
+	// Parts are views into the already scanned library
+	start_at_current_collection_part();
 }
 
-void scan_current_mount()
+void apply_track_metadata(Track &track, const TrackMetadata &md)
 {
-	if(current_collection_part != "")
-		printf_("Scanning (collection: \"%s\")\n", cs(current_collection_part));
-	else
-		printf_("Scanning...\n");
+	if(!use_tag_track_names)
+		return;
+	track.track_number = md.track_number;
+	if(md.title != "")
+		track.display_name = md.title;
+}
 
-	//disappeared_tracks.clear();
-	current_media_content.albums.clear();
+// Collects tag updates and applies them to a copy of the library, which then
+// replaces the current one. Throttled because the copy isn't free.
+void handle_metadata_updates()
+{
+	// Tags completed during a scan are picked up once the scan is done
+	auto &mc = current_media_content;
+	if(scan_in_progress || !mc.albums.library)
+		return;
+	static set_<ss_> pending_paths;
+	static time_t last_apply_timestamp = 0;
+	sv_<ss_> completed_paths = metadata_cache::pop_completed();
+	if(!completed_paths.empty()){
+		// Album durations may have changed
+		mc.albums_by_minutes.valid = false;
+	}
+	for(const ss_ &path : completed_paths){
+		if(use_tag_track_names)
+			pending_paths.insert(path);
+	}
+	if(pending_paths.empty() || last_apply_timestamp > time(0) - 2)
+		return;
+	last_apply_timestamp = time(0);
+
+	const Library &old_library = *mc.albums.library;
+	sp_<Library> library; // Copied when the first change is found
+	sm_<size_t, sp_<Album>> changed_albums;
+	for(const ss_ &path : pending_paths){
+		auto it = old_library.track_indices_by_path.find(path);
+		if(it == old_library.track_indices_by_path.end())
+			continue;
+		TrackMetadata md;
+		if(!metadata_cache::get(path, md))
+			continue;
+		const Track &old_track =
+				old_library.albums[it->second.first]->tracks[it->second.second];
+		Track track = old_track;
+		apply_track_metadata(track, md);
+		if(track.display_name == old_track.display_name &&
+				track.track_number == old_track.track_number)
+			continue;
+		if(!library)
+			library.reset(new Library(old_library));
+		sp_<Album> &album = changed_albums[it->second.first];
+		if(!album){
+			album.reset(new Album(*old_library.albums[it->second.first]));
+			library->albums[it->second.first] = album;
+		}
+		album->tracks[it->second.second] = track;
+		// Keep the cursor pointing to the renamed track
+		if(current_cursor.track_name == old_track.display_name &&
+				get_track(mc, current_cursor).path == path){
+			current_cursor.track_name = track.display_name;
+			if(last_succesfully_playing_cursor.track_name == old_track.display_name)
+				last_succesfully_playing_cursor.track_name = track.display_name;
+		}
+	}
+	pending_paths.clear();
+
+	// Albums whose tracks got reordered by track number
+	sm_<size_t, sv_<u32>> new_track_is_by_album;
+	for(auto &pair : changed_albums){
+		Album &album = *pair.second;
+		sv_<u32> new_track_is;
+		if(sort_album_by_track_numbers(album, &new_track_is)){
+			for(size_t ti=0; ti<album.tracks.size(); ti++){
+				library->track_indices_by_path[album.tracks[ti].path] =
+						std::make_pair(pair.first, ti);
+			}
+			new_track_is_by_album[pair.first] = new_track_is;
+		}
+		smart_shuffle_scan_album(album);
+	}
 
-	ss_ scan_midfix;
-	if(current_collection_part != "")
-		scan_midfix = "/"+current_collection_part;
+	if(new_track_is_by_album.empty()){
+		// Same albums at the same indices; the view stays valid
+		if(library)
+			mc.albums.library = library;
+		return;
+	}
 
-	if(!static_media_paths.empty()){
-		int n = 1;
-		for(const ss_ &path : static_media_paths){
-			ss_ root_name = static_media_paths.size() == 1 ? "root" : "root_"+itos(n++);
-			scan_directory(root_name, path+scan_midfix, current_media_content.albums);
+	ss_ current_path = get_track(mc, current_cursor).path;
+	ss_ last_path = get_track(mc, last_succesfully_playing_cursor).path;
+	mc.albums.library = library;
+	// The track orders and the cursors follow the tracks to their new indices
+	for(size_t i=0; i<mc.albums.indices.size(); i++){
+		auto it = new_track_is_by_album.find(mc.albums.indices[i]);
+		if(it == new_track_is_by_album.end())
+			continue;
+		for(int kind=0; kind<TOK_NUM_KINDS; kind++){
+			const u32 *order = find_track_order(mc, (TrackOrderKind)kind, i);
+			if(!order)
+				continue;
+			sv_<u32> new_order(it->second.size());
+			for(size_t j=0; j<new_order.size(); j++)
+				new_order[j] = it->second[order[j]];
+			set_track_order(mc, (TrackOrderKind)kind, i, new_order.data());
 		}
-	} else {
-		scan_directory("root", current_mount_path+scan_midfix, current_media_content.albums);
 	}
+	remap_cursor_to_path(mc, last_succesfully_playing_cursor, last_path);
+	remap_cursor_to_path(mc, current_cursor, current_path);
+}
 
-	// Create shuffled orders
-	reshuffle_all_media(current_media_content);
+static sv_<CollectionPart> merge_collection_parts(const sv_<CollectionPart> &parts)
+{
+	sm_<ss_, CollectionPart> parts_by_name;
+	for(const CollectionPart &subdir_part : parts){
+		CollectionPart &part = parts_by_name[subdir_part.name];
+		part.name = subdir_part.name;
+		for(auto &range : subdir_part.album_ranges)
+			part.album_ranges.push_back(range);
+	}
+	sv_<CollectionPart> result;
+	for(auto &pair : parts_by_name)
+		result.push_back(pair.second);
+	std::sort(result.begin(), result.end(),
+			[](const CollectionPart &a, const CollectionPart &b){
+				return a.name < b.name;
+			});
+	return result;
+}
 
-	printf_("Scanned %zu albums.\n", current_media_content.albums.size());
+// Called by the scan thread after each found album, and when done
+static void publish_scan_progress(const sv_<sp_<const Album>> &albums, bool complete)
+{
+	ScanState &ss = scan_state;
+	if(!complete){
+		if(!ss.stream)
+			return;
+		// The first album right away, then at intervals
+		auto now = std::chrono::steady_clock::now();
+		if(ss.num_published_albums != 0 && now - ss.last_publish_time <
+				std::chrono::milliseconds(SCAN_PUBLISH_INTERVAL_MS))
+			return;
+		ss.last_publish_time = now;
+	}
 
-	current_cursor = last_succesfully_playing_cursor;
+	for(; ss.num_indexed_albums < albums.size(); ss.num_indexed_albums++){
+		const Album &album = *albums[ss.num_indexed_albums];
+		for(size_t ti=0; ti<album.tracks.size(); ti++){
+			ss.track_indices_by_path[album.tracks[ti].path] =
+					std::make_pair(ss.num_indexed_albums, ti);
+		}
+	}
 
-	if(current_cursor.album_seq_i == 0 && current_cursor.track_seq_i == 0 &&
-			current_cursor.track_name == ""){
-		if(LOG_DEBUG)
-			printf_("Starting without saved state; picking random album\n");
-		command_random_album();
+	sp_<Library> library(new Library());
+	library->albums = albums;
+	library->parts = merge_collection_parts(ss.parts);
+	library->track_indices_by_path = ss.track_indices_by_path;
+	library->scan_complete = complete;
+	ss.num_published_albums = albums.size();
+
+	if(!scan_cancel_requested)
+		std::atomic_store(&published_library, sp_<const Library>(library));
+}
+
+// Runs in the scan thread
+static void scan_media_paths(const sv_<ss_> &media_paths, bool stream)
+{
+	scan_state = ScanState();
+	scan_state.stream = stream;
+
+	// Top-level directories of all media paths become collection parts
+	sv_<sp_<const Album>> albums;
+	int n = 1;
+	for(const ss_ &path : media_paths){
+		ss_ root_name = media_paths.size() == 1 ? "root" : "root_"+itos(n++);
+		scan_directory(root_name, path, albums, NULL, &scan_state.parts);
+	}
+
+	publish_scan_progress(albums, true);
+}
+
+void stop_scan()
+{
+	if(!scan_thread.joinable())
+		return;
+	scan_cancel_requested = true;
+	scan_thread.join();
+	scan_cancel_requested = false;
+	scan_in_progress = false;
+	// Drop a result that wasn't picked up yet
+	std::atomic_store(&published_library, sp_<const Library>());
+}
+
+static void start_scan()
+{
+	stop_scan();
+
+	sv_<ss_> media_paths;
+	if(!static_media_paths.empty())
+		media_paths = static_media_paths;
+	else
+		media_paths.push_back(current_mount_path);
+
+	// Stream partial results only if there's nothing to show meanwhile
+	bool stream = !current_media_content.albums.library;
+
+	scan_in_progress = true;
+	scan_thread = std::thread([media_paths, stream](){
+		scan_media_paths(media_paths, stream);
+	});
+	static bool atexit_registered = false;
+	if(!atexit_registered){
+		atexit(stop_scan);
+		atexit_registered = true;
+	}
+}
+
+// Whether the cursor saved from last time can be resolved. Without one, a
+// random album is picked, which has to wait for the whole library.
+static bool can_start_at_library(const Library &library)
+{
+	if(library.scan_complete)
+		return true;
+	if(current_collection_part != "" &&
+			!find_collection_part(library, current_collection_part))
+		return false;
+	const PlayCursor &cursor = last_succesfully_playing_cursor;
+	if(cursor.track_name == "")
+		return false;
+	for(auto &album : library.albums){
+		if(album->name == cursor.album_name)
+			return true;
+	}
+	return false;
+}
+
+// Swaps in a new library, keeping the cursor on the same track if it still
+// exists
+static void replace_library(const sp_<const Library> &library)
+{
+	auto &mc = current_media_content;
+	if(waiting_for_first_library){
+		if(!can_start_at_library(*library)){
+			// Show what has been found so far
+			mc.albums.library = library;
+			select_collection_part(mc, library, current_collection_part);
+			return;
+		}
+		waiting_for_first_library = false;
+		mc.albums.library = library;
+		start_at_current_collection_part();
 		return;
 	}
 
-	if(!static_media_paths.empty() && current_media_content.albums.empty()){
-		// There are static media paths and there are no tracks; do nothing
-		printf_("No media.\n");
+	ss_ current_path = get_track(mc, current_cursor).path;
+	ss_ last_path = get_track(mc, last_succesfully_playing_cursor).path;
+
+	// Albums that are still there keep their places in the album orders
+	sv_<ss_> old_album_names;
+	old_album_names.reserve(mc.albums.size());
+	for(auto &album : mc.albums)
+		old_album_names.push_back(album.name);
+	sv_<u32> old_shuffled_order = mc.shuffled_album_order;
+	sv_<u32> old_mr_shuffled_order = mc.mr_shuffled_album_order;
+	sv_<u32> old_weighted_order = mc.weighted_album_order;
+
+	// Albums that are still the same keep their track orders
+	sm_<const Album*, sv_<u32>> old_track_orders[TOK_NUM_KINDS];
+	for(int kind=0; kind<TOK_NUM_KINDS; kind++){
+		for(size_t i=0; i<mc.albums.size(); i++){
+			const u32 *order = find_track_order(mc, (TrackOrderKind)kind, i);
+			if(order)
+				old_track_orders[kind][&mc.albums[i]].assign(order,
+						order + mc.albums[i].tracks.size());
+		}
+	}
+
+	if(!select_collection_part(mc, library, current_collection_part)){
+		if(!library->scan_complete)
+			return; // It may still appear
+		printf_("Collection part \"%s\" doesn't exist anymore; using all\n",
+				cs(current_collection_part));
+		current_collection_part = "";
+		select_collection_part(mc, library, current_collection_part);
+	}
+	if(mc.albums.empty())
 		return;
+
+	keep_album_orders(mc, old_album_names, old_shuffled_order,
+			old_mr_shuffled_order, old_weighted_order);
+
+	for(int kind=0; kind<TOK_NUM_KINDS; kind++){
+		for(size_t i=0; i<mc.albums.size(); i++){
+			auto it = old_track_orders[kind].find(&mc.albums[i]);
+			if(it != old_track_orders[kind].end())
+				set_track_order(mc, (TrackOrderKind)kind, i, it->second.data());
+		}
 	}
 
-	if(!force_resolve_track(current_media_content, current_cursor)){
-		printf_("Force-resolve track failed; picking random album\n");
+	remap_cursor_to_path(mc, last_succesfully_playing_cursor, last_path);
+	if(!remap_cursor_to_path(mc, current_cursor, current_path) &&
+			!force_resolve_track(mc, current_cursor)){
+		printf_("Current track disappeared; picking random album\n");
 		command_random_album();
+	}
+}
+
+void handle_scan_results()
+{
+	sp_<const Library> library =
+			std::atomic_exchange(&published_library, sp_<const Library>());
+	if(!library)
 		return;
+
+	if(library->scan_complete){
+		scan_thread.join();
+		scan_in_progress = false;
+		printf_("Scanned %zu albums in %zu collection parts.\n",
+				library->albums.size(), library->parts.size());
+	} else if(LOG_DEBUG){
+		printf_("Scanned %zu albums so far\n", library->albums.size());
 	}
 
-	force_start_at_cursor();
-	ui_show_changed_album();
+	ui_output_queue::push_message("Scanned "+itos(library->albums.size())+" albums",
+			"SCAN "+itos(library->albums.size()), ui_output_queue::MP_LOW);
+
+	replace_library(library);
 }
 
-bool check_partition_exists(const ss_ &devname0)
+void clear_media_content()
+{
+	stop_scan();
+	waiting_for_first_library = true;
+	current_media_content.albums.clear();
+	current_media_content.albums.library.reset();
+}
+
+void scan_current_mount()
 {
-	std::ifstream f("/proc/partitions");
+	printf_("Scanning...\n");
+
+	// Different media; the old library is of no use
+	clear_media_content();
+
+	start_scan();
+}
+
+void rescan_current_mount()
+{
+	if(current_mount_path == ""){
+		printf_("No media to rescan\n");
+		return;
+	}
+	printf_("Rescanning...\n");
+
+	// The current library stays in use until the new one is ready
+	start_scan();
+}
+
+// Partitions and mounts read from /proc at one point in time
+struct PartitionState
+{
+	sv_<ss_> partitions;
+	sm_<ss_, ss_> mountpoints; // Device name -> mount point
+};
+
+static ss_ read_whole_file(const char *path)
+{
+	std::ifstream f(path);
 	if(!f.good()){
-		printf_("Can't read /proc/partitions\n");
-		return false;
+		printf_("Can't read %s\n", path);
+		return "";
 	}
-	ss_ proc_partitions_data = ss_((std::istreambuf_iterator<char>(f)),
+	return ss_((std::istreambuf_iterator<char>(f)),
 			std::istreambuf_iterator<char>());
+}
 
-	Strfnd f_lines(proc_partitions_data);
+static PartitionState read_partition_state()
+{
+	PartitionState result;
+
+	ss_ proc_partitions_data = read_whole_file("/proc/partitions");
+	StrfndRef f_lines(proc_partitions_data);
 	for(;;){
 		if(f_lines.atend()) break;
-		ss_ line = f_lines.next("\n");
-		Strfnd f_columns(line);
+		StrfndRef f_columns(f_lines.next("\n"));
 		f_columns.while_any(" ");
 		f_columns.next(" ");
 		f_columns.while_any(" ");
@@ -269,53 +686,71 @@ bool check_partition_exists(const ss_ &devname0)
 		f_columns.while_any(" ");
 		f_columns.next(" ");
 		f_columns.while_any(" ");
-		ss_ devname = f_columns.next(" ");
-		if(devname == "")
+		StrRef devname = f_columns.next(" ");
+		if(devname.empty())
 			continue;
-		if(devname == devname0)
-			return true;
-	}
-	return false;
-}
-
-ss_ get_device_mountpoint(const ss_ &devname0)
-{
-	std::ifstream f("/proc/mounts");
-	if(!f.good()){
-		printf_("Can't read /proc/mounts\n");
-		return "";
+		result.partitions.push_back(devname.str());
 	}
-	ss_ proc_mounts_data = ss_((std::istreambuf_iterator<char>(f)),
-			std::istreambuf_iterator<char>());
 
-	Strfnd f_lines(proc_mounts_data);
+	ss_ proc_mounts_data = read_whole_file("/proc/mounts");
+	StrfndRef f_mount_lines(proc_mounts_data);
 	for(;;){
-		if(f_lines.atend()) break;
-		ss_ line = f_lines.next("\n");
-		Strfnd f_columns(line);
+		if(f_mount_lines.atend()) break;
+		StrfndRef f_columns(f_mount_lines.next("\n"));
 		f_columns.while_any(" ");
-		ss_ devpath = f_columns.next(" ");
+		StrfndRef f_devpath(f_columns.next(" "));
 		f_columns.while_any(" ");
-		ss_ mountpoint = f_columns.next(" ");
-		Strfnd f_devpath(devpath);
-		ss_ devname;
+		StrRef mountpoint = f_columns.next(" ");
+		StrRef devname;
 		for(;;){
-			ss_ s = f_devpath.next("/");
-			if(s != "")
+			StrRef s = f_devpath.next("/");
+			if(!s.empty())
 				devname = s;
 			if(f_devpath.atend())
 				break;
 		}
-		if(devname == devname0){
-			/*printf_("is_device_mounted(): %s is mounted at %s\n",
-					cs(devname0), cs(mountpoint));*/
-			return mountpoint;
-		}
+		// First one wins, like when searching the file
+		if(!devname.empty())
+			result.mountpoints.insert(std::make_pair(devname.str(), mountpoint.str()));
 	}
-	//printf_("is_device_mounted(): %s is not mounted\n", cs(devname0));
-	return "";
+
+	return result;
+}
+
+static bool check_partition_exists(const PartitionState &ps, const ss_ &devname0)
+{
+	for(const ss_ &devname : ps.partitions){
+		if(devname == devname0)
+			return true;
+	}
+	return false;
+}
+
+static ss_ get_device_mountpoint(const PartitionState &ps, const ss_ &devname0)
+{
+	auto it = ps.mountpoints.find(devname0);
+	if(it == ps.mountpoints.end())
+		return "";
+	return it->second;
+}
+
+bool check_partition_exists(const ss_ &devname0)
+{
+	return check_partition_exists(read_partition_state(), devname0);
 }
 
+ss_ get_device_mountpoint(const ss_ &devname0)
+{
+	return get_device_mountpoint(read_partition_state(), devname0);
+}
+
+#ifndef __WIN32__
+// Non-zero while the media is gone but couldn't be unmounted yet
+static time_t umount_last_failed_timestamp = 0;
+// Non-zero while a tracked partition exists but couldn't be mounted
+static time_t mount_last_failed_timestamp = 0;
+#endif
+
 void handle_changed_partitions()
 {
 	if(!static_media_paths.empty()){
@@ -332,32 +767,42 @@ void handle_changed_partitions()
 	}
 
 #ifndef __WIN32__
+	PartitionState ps = read_partition_state();
+
 	if(current_mount_device != ""){
-		if(!check_partition_exists(current_mount_device)){
-			static time_t umount_last_failed_timestamp = 0;
+		if(!check_partition_exists(ps, current_mount_device)){
 			if(umount_last_failed_timestamp > time(0) - 15){
 				// Stop flooding these dumb commands
 			} else {
 				// Unmount it if the partition doesn't exist anymore
 				printf_("Device %s does not exist anymore; umounting\n",
 						cs(current_mount_path));
+				// An open file would keep the mount busy
+				stop_scan();
+				prefetch::set_next("");
+				transcode_cache::cancel();
+				metadata_cache::clear();
 				int r = umount(current_mount_path.c_str());
 				if(r == 0){
 					printf_("umount %s succesful\n", current_mount_path.c_str());
+					umount_last_failed_timestamp = 0;
 					current_mount_device = "";
 					current_mount_path = "";
-					current_media_content.albums.clear();
+					clear_media_content();
 				} else {
 					printf_("umount %s failed: %s\n", current_mount_path.c_str(), strerror(errno));
 					umount_last_failed_timestamp = time(0);
 				}
 			}
-		} else if(get_device_mountpoint(current_mount_device) == ""){
-			printf_("Device %s got unmounted from %s\n", cs(current_mount_device),
-					cs(current_mount_path));
-			current_mount_device = "";
-			current_mount_path = "";
-			current_media_content.albums.clear();
+		} else {
+			umount_last_failed_timestamp = 0;
+			if(get_device_mountpoint(ps, current_mount_device) == ""){
+				printf_("Device %s got unmounted from %s\n", cs(current_mount_device),
+						cs(current_mount_path));
+				current_mount_device = "";
+				current_mount_path = "";
+				clear_media_content();
+			}
 		}
 	}
 
@@ -368,29 +813,8 @@ void handle_changed_partitions()
 		return;
 	}
 
-	std::ifstream f("/proc/partitions");
-	if(!f.good()){
-		printf_("Can't read /proc/partitions\n");
-		return;
-	}
-	ss_ proc_partitions_data = ss_((std::istreambuf_iterator<char>(f)),
-			std::istreambuf_iterator<char>());
-
-	Strfnd f_lines(proc_partitions_data);
-	for(;;){
-		if(f_lines.atend()) break;
-		ss_ line = f_lines.next("\n");
-		Strfnd f_columns(line);
-		f_columns.while_any(" ");
-		f_columns.next(" ");
-		f_columns.while_any(" ");
-		f_columns.next(" ");
-		f_columns.while_any(" ");
-		f_columns.next(" ");
-		f_columns.while_any(" ");
-		ss_ devname = f_columns.next(" ");
-		if(devname == "")
-			continue;
+	bool mount_failed = false;
+	for(const ss_ &devname : ps.partitions){
 		bool found = false;
 		for(const ss_ &s : track_devices){
 			if(devname.size() < s.size())
@@ -405,12 +829,13 @@ void handle_changed_partitions()
 			continue;
 		printf_("Tracked partition: %s\n", cs(devname));
 
-		ss_ existing_mountpoint = get_device_mountpoint(devname);
+		ss_ existing_mountpoint = get_device_mountpoint(ps, devname);
 		if(existing_mountpoint != ""){
 			printf_("%s is already mounted at %s; using it\n",
 					cs(devname), cs(existing_mountpoint));
 			current_mount_device = devname;
 			current_mount_path = existing_mountpoint;
+			mount_last_failed_timestamp = 0;
 
 			scan_current_mount();
 			return;
@@ -429,13 +854,16 @@ void handle_changed_partitions()
 			printf_("Succesfully mounted.\n");
 			current_mount_device = devname;
 			current_mount_path = new_mount_path;
+			mount_last_failed_timestamp = 0;
 
 			scan_current_mount();
 			return;
 		} else {
 			printf_("Failed to mount (%s); trying next\n", strerror(errno));
+			mount_failed = true;
 		}
 	}
+	mount_last_failed_timestamp = mount_failed ? time(0) : 0;
 #endif
 }
 
@@ -447,6 +875,18 @@ void handle_mount()
 	if(!static_media_paths.empty())
 		return;
 
+	if(uevent::is_available()){
+		// Changes arrive as uevents; only retry a failed umount or mount here
+		if((umount_last_failed_timestamp != 0 &&
+				umount_last_failed_timestamp <= time(0) - 15) ||
+				(mount_last_failed_timestamp != 0 &&
+				mount_last_failed_timestamp <= time(0) - 15))
+			handle_changed_partitions();
+		return;
+	}
+
+	// Fallback when uevents are unavailable: inotify and polling
+
 	// Calls callbacks; eg. handle_changed_partitions()
 	for(auto fd : partitions_watch->get_fds()){
 		partitions_watch->report_fd(fd);
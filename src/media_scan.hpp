@@ -4,11 +4,21 @@
 #include "play_cursor.hpp"
 
 bool filename_supported(const ss_ &name);
-void scan_directory(const ss_ &root_name, const ss_ &path, sv_<Album> &result_albums,
-		Album *parent_dir_album=NULL);
+// If subdir_parts is set, the albums found in each subdirectory are added to
+// it as a collection part
+void scan_directory(const ss_ &root_name, const ss_ &path,
+		sv_<sp_<const Album>> &result_albums, Album *parent_dir_album=NULL,
+		sv_<CollectionPart> *subdir_parts=NULL);
 sv_<ss_> get_collection_parts();
 void set_collection_part(const ss_ &part);
+void apply_track_metadata(Track &track, const TrackMetadata &md);
+void handle_metadata_updates();
+void stop_scan();
+void handle_scan_results();
+void clear_media_content();
+// Scans in the background; the library is replaced when the scan is done
 void scan_current_mount();
+void rescan_current_mount();
 bool check_partition_exists(const ss_ &devname0);
 ss_ get_device_mountpoint(const ss_ &devname0);
 void handle_changed_partitions();
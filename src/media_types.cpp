@@ -0,0 +1,121 @@
+#include "media_types.hpp"
+#include <string.h>
+#include <ctype.h>
+
+MediaTypeConfig media_type_config;
+
+// FNV-1a; evaluated at compile time for the case labels below, so a collision
+// between two extensions is a duplicate case compile error
+static constexpr u32 extension_hash(const char *s, u32 h = 2166136261u)
+{
+	return *s == 0 ? h : extension_hash(s + 1, (h ^ (u8)*s) * 16777619u);
+}
+
+static const size_t MAX_EXTENSION_LEN = 7;
+
+static MediaFileType classify_lowercase_extension(const char *ext)
+{
+	// Not all of these are even actually supported but at least nothing
+	// ridiculous is included so that browsing random USB storage things is
+	// possible.
+	// These don't really work properly (playlists or unsupported formats):
+	// "m3u", "pls", "srt", "spc", "t64", "xm", "rar", "sid", "mod", "it"
+#define EXT(e, type) case extension_hash(e): return strcmp(ext, e) == 0 ? type : MFT_NONE;
+	switch(extension_hash(ext)){
+	EXT("3ga", MFT_AUDIO) EXT("aac", MFT_AUDIO) EXT("aif", MFT_AUDIO)
+	EXT("aifc", MFT_AUDIO) EXT("aiff", MFT_AUDIO) EXT("amr", MFT_AUDIO)
+	EXT("au", MFT_AUDIO) EXT("aup", MFT_AUDIO) EXT("caf", MFT_AUDIO)
+	EXT("cue", MFT_AUDIO) EXT("d64", MFT_AUDIO) EXT("flac", MFT_AUDIO)
+	EXT("gsm", MFT_AUDIO) EXT("iff", MFT_AUDIO) EXT("kar", MFT_AUDIO)
+	EXT("m4a", MFT_AUDIO) EXT("m4p", MFT_AUDIO) EXT("m4r", MFT_AUDIO)
+	EXT("mid", MFT_AUDIO) EXT("midi", MFT_AUDIO) EXT("mmf", MFT_AUDIO)
+	EXT("mp2", MFT_AUDIO) EXT("mp3", MFT_AUDIO) EXT("mpga", MFT_AUDIO)
+	EXT("ogg", MFT_AUDIO) EXT("oma", MFT_AUDIO) EXT("opus", MFT_AUDIO)
+	EXT("qcp", MFT_AUDIO) EXT("ra", MFT_AUDIO) EXT("ram", MFT_AUDIO)
+	EXT("s3m", MFT_AUDIO) EXT("sfv", MFT_AUDIO) EXT("wav", MFT_AUDIO)
+	EXT("wma", MFT_AUDIO) EXT("xd", MFT_AUDIO) EXT("xspf", MFT_AUDIO)
+	EXT("3g2", MFT_VIDEO) EXT("3gp", MFT_VIDEO) EXT("3gpp", MFT_VIDEO)
+	EXT("asf", MFT_VIDEO) EXT("avi", MFT_VIDEO) EXT("divx", MFT_VIDEO)
+	EXT("f4v", MFT_VIDEO) EXT("flv", MFT_VIDEO) EXT("h264", MFT_VIDEO)
+	EXT("ifo", MFT_VIDEO) EXT("m2ts", MFT_VIDEO) EXT("m4v", MFT_VIDEO)
+	EXT("mkv", MFT_VIDEO) EXT("mov", MFT_VIDEO) EXT("mp4", MFT_VIDEO)
+	EXT("mpeg", MFT_VIDEO) EXT("mpg", MFT_VIDEO) EXT("mswmm", MFT_VIDEO)
+	EXT("mts", MFT_VIDEO) EXT("mxf", MFT_VIDEO) EXT("ogv", MFT_VIDEO)
+	EXT("rm", MFT_VIDEO) EXT("swf", MFT_VIDEO) EXT("ts", MFT_VIDEO)
+	EXT("vep", MFT_VIDEO) EXT("vob", MFT_VIDEO) EXT("webm", MFT_VIDEO)
+	EXT("wlmp", MFT_VIDEO) EXT("wmv", MFT_VIDEO)
+	}
+#undef EXT
+	return MFT_NONE;
+}
+
+MediaFileType classify_file_extension(const char *name)
+{
+	const char *dot = strrchr(name, '.');
+	if(dot == NULL)
+		return MFT_NONE;
+	size_t len = strlen(dot + 1);
+	if(len == 0)
+		return MFT_NONE;
+	if(len <= MAX_EXTENSION_LEN){
+		char ext[MAX_EXTENSION_LEN + 1];
+		for(size_t i=0; i<=len; i++)
+			ext[i] = tolower(dot[1 + i]);
+		MediaFileType type = classify_lowercase_extension(ext);
+		if(type != MFT_NONE || media_type_config.extra_extensions.empty())
+			return type;
+	}
+	if(media_type_config.extra_extensions.empty())
+		return MFT_NONE;
+	ss_ ext(dot + 1);
+	for(char &c : ext)
+		c = tolower(c);
+	return media_type_config.extra_extensions.count(ext) ? MFT_AUDIO : MFT_NONE;
+}
+
+MediaFileType sniff_media_type(const u8 *d, size_t len)
+{
+	if(len >= 12 && memcmp(d, "RIFF", 4) == 0){
+		if(memcmp(d + 8, "WAVE", 4) == 0)
+			return MFT_AUDIO;
+		if(memcmp(d + 8, "AVI ", 4) == 0)
+			return MFT_VIDEO;
+		return MFT_NONE;
+	}
+	if(len >= 12 && memcmp(d + 4, "ftyp", 4) == 0){
+		// M4A and M4B are audio; everything else in the MP4 family is
+		// assumed to have video
+		if(memcmp(d + 8, "M4A ", 4) == 0 || memcmp(d + 8, "M4B ", 4) == 0)
+			return MFT_AUDIO;
+		return MFT_VIDEO;
+	}
+	if(len >= 4 && (memcmp(d, "fLaC", 4) == 0 || memcmp(d, "OggS", 4) == 0))
+		return MFT_AUDIO;
+	if(len >= 3 && memcmp(d, "ID3", 3) == 0)
+		return MFT_AUDIO;
+	// MPEG audio frame sync with a valid layer, or ADTS AAC (layer 00)
+	if(len >= 2 && d[0] == 0xff && (d[1] & 0xe0) == 0xe0 &&
+			((d[1] & 0x06) != 0 || (d[1] & 0xf6) == 0xf0))
+		return MFT_AUDIO;
+	return MFT_NONE;
+}
+
+bool media_type_wanted(MediaFileType type)
+{
+	if(type == MFT_VIDEO)
+		return !media_type_config.audio_only;
+	return type == MFT_AUDIO;
+}
+
+// With vo=null mpv still selects and decodes the video stream of a video
+// container; these keep it to the audio and a small demuxer cache
+const char* media_type_mpv_file_options(MediaFileType type)
+{
+	switch(type){
+	case MFT_VIDEO:
+		return "vid=no,sid=no,cache=no,demuxer-max-bytes=2MiB,"
+				"demuxer-max-back-bytes=0";
+	default:
+		return "";
+	}
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include "types.hpp"
+
+enum MediaFileType {
+	MFT_NONE,
+	MFT_AUDIO,
+	MFT_VIDEO, // Containers that usually have video; only the audio is played
+};
+
+// Set from command line arguments before scanning
+struct MediaTypeConfig
+{
+	bool audio_only = false; // Skip video containers
+	bool sniff_content = false; // Look inside files with an unknown extension
+	set_<ss_> extra_extensions; // Lowercase; treated as audio
+};
+extern MediaTypeConfig media_type_config;
+
+// Classifies by extension only; no allocation for the built-in extensions
+MediaFileType classify_file_extension(const char *name);
+// Classifies by the first bytes of a file's content (MP3 frame sync, ID3,
+// fLaC, OggS, RIFF, ftyp)
+MediaFileType sniff_media_type(const u8 *data, size_t len);
+static const size_t MEDIA_SNIFF_SIZE = 12;
+// Whether a file of this type is included in the library
+bool media_type_wanted(MediaFileType type);
+// File-local mpv options ("key=value,...") that files of the type are loaded
+// with; they're reset when the next file is loaded
+const char* media_type_mpv_file_options(MediaFileType type);
@@ -0,0 +1,714 @@
+#include "metadata.hpp"
+#include "string_util.hpp"
+#include "stuff2.hpp"
+#include "print.hpp"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static u16 be16(const u8 *p){ return (p[0]<<8) | p[1]; }
+static u32 be32(const u8 *p){ return ((u32)p[0]<<24) | (p[1]<<16) | (p[2]<<8) | p[3]; }
+static u64 be64(const u8 *p){ return ((u64)be32(p)<<32) | be32(p+4); }
+static u16 le16(const u8 *p){ return p[0] | (p[1]<<8); }
+static u32 le32(const u8 *p){ return p[0] | (p[1]<<8) | (p[2]<<16) | ((u32)p[3]<<24); }
+static u64 le64(const u8 *p){ return le32(p) | ((u64)le32(p+4)<<32); }
+
+struct ProbeFile
+{
+	int fd = -1;
+	u64 size = 0;
+
+	ProbeFile(const ss_ &path)
+	{
+		fd = open(path.c_str(), O_RDONLY);
+		struct stat st;
+		if(fd != -1 && fstat(fd, &st) == 0)
+			size = st.st_size;
+	}
+	~ProbeFile()
+	{
+		if(fd != -1)
+			close(fd);
+	}
+	// Returns number of bytes read
+	size_t read_at(u64 offset, void *buf, size_t len)
+	{
+		if(fd == -1 || offset >= size)
+			return 0;
+		size_t got = 0;
+		while(got < len){
+			ssize_t r = pread(fd, (u8*)buf + got, len - got, offset + got);
+			if(r <= 0)
+				break;
+			got += r;
+		}
+		return got;
+	}
+};
+
+// Returns offset of the data following an ID3v2 tag, or 0 if there is none
+static u64 skip_id3v2(ProbeFile &f)
+{
+	u8 h[10];
+	if(f.read_at(0, h, 10) != 10 || memcmp(h, "ID3", 3) != 0)
+		return 0;
+	u64 size = ((h[6] & 0x7f) << 21) | ((h[7] & 0x7f) << 14) |
+			((h[8] & 0x7f) << 7) | (h[9] & 0x7f);
+	if(h[5] & 0x10)
+		size += 10; // Footer
+	return 10 + size;
+}
+
+// Titles end up in the line-based cache file and on the display
+static ss_ clean_tag_text(const ss_ &s)
+{
+	ss_ result = s;
+	for(size_t i=0; i<result.size(); i++){
+		if((u8)result[i] < 0x20)
+			result[i] = ' ';
+	}
+	return trim(result);
+}
+
+static void append_utf8(ss_ &s, u32 c)
+{
+	if(c < 0x80){
+		s += (char)c;
+	} else if(c < 0x800){
+		s += (char)(0xc0 | (c >> 6));
+		s += (char)(0x80 | (c & 0x3f));
+	} else if(c < 0x10000){
+		s += (char)(0xe0 | (c >> 12));
+		s += (char)(0x80 | ((c >> 6) & 0x3f));
+		s += (char)(0x80 | (c & 0x3f));
+	} else {
+		s += (char)(0xf0 | (c >> 18));
+		s += (char)(0x80 | ((c >> 12) & 0x3f));
+		s += (char)(0x80 | ((c >> 6) & 0x3f));
+		s += (char)(0x80 | (c & 0x3f));
+	}
+}
+
+// Converts the text of an ID3v2 text frame to UTF-8. Only the first value
+// of multi-value frames is returned.
+static ss_ decode_id3v2_text(const u8 *data, size_t len)
+{
+	ss_ result;
+	if(len < 1)
+		return result;
+	u8 encoding = data[0];
+	const u8 *p = data + 1;
+	const u8 *end = data + len;
+	if(encoding == 0 || encoding == 3){
+		for(; p < end && *p != 0; p++){
+			if(encoding == 0)
+				append_utf8(result, *p);
+			else
+				result += (char)*p;
+		}
+		return result;
+	}
+	bool big_endian = (encoding == 2);
+	if(encoding == 1 && p + 2 <= end){
+		big_endian = (p[0] == 0xfe && p[1] == 0xff);
+		p += 2;
+	}
+	for(; p + 2 <= end; p += 2){
+		u32 c = big_endian ? be16(p) : le16(p);
+		if(c == 0)
+			break;
+		if(c >= 0xd800 && c < 0xdc00 && p + 4 <= end){
+			u32 c2 = big_endian ? be16(p + 2) : le16(p + 2);
+			if(c2 >= 0xdc00 && c2 < 0xe000){
+				c = 0x10000 + ((c - 0xd800) << 10) + (c2 - 0xdc00);
+				p += 2;
+			}
+		}
+		append_utf8(result, c);
+	}
+	return result;
+}
+
+static void parse_id3v2(ProbeFile &f, TrackMetadata &md)
+{
+	u8 h[10];
+	if(f.read_at(0, h, 10) != 10 || memcmp(h, "ID3", 3) != 0)
+		return;
+	int version = h[3];
+	u64 tag_end = 10 + (((h[6] & 0x7f) << 21) | ((h[7] & 0x7f) << 14) |
+			((h[8] & 0x7f) << 7) | (h[9] & 0x7f));
+	u64 offset = 10;
+	if((h[5] & 0x40) && version >= 3){
+		// Extended header
+		u8 eh[4];
+		if(f.read_at(offset, eh, 4) != 4)
+			return;
+		if(version == 3)
+			offset += 4 + be32(eh);
+		else
+			offset += ((eh[0] & 0x7f) << 21) | ((eh[1] & 0x7f) << 14) |
+					((eh[2] & 0x7f) << 7) | (eh[3] & 0x7f);
+	}
+	size_t header_len = version == 2 ? 6 : 10;
+	while(offset + header_len <= tag_end){
+		u8 fh[10];
+		if(f.read_at(offset, fh, header_len) != header_len || fh[0] == 0)
+			break; // Padding
+		u32 size;
+		if(version == 2)
+			size = (fh[3] << 16) | (fh[4] << 8) | fh[5];
+		else if(version == 3)
+			size = be32(fh + 4);
+		else
+			size = ((fh[4] & 0x7f) << 21) | ((fh[5] & 0x7f) << 14) |
+					((fh[6] & 0x7f) << 7) | (fh[7] & 0x7f);
+		offset += header_len;
+		bool is_title = version == 2 ? memcmp(fh, "TT2", 3) == 0 :
+				memcmp(fh, "TIT2", 4) == 0;
+		bool is_track = version == 2 ? memcmp(fh, "TRK", 3) == 0 :
+				memcmp(fh, "TRCK", 4) == 0;
+		// Other frames (like cover images) are skipped without reading them
+		if((is_title || is_track) && size < 1024){
+			u8 data[1024];
+			size_t len = f.read_at(offset, data, size);
+			ss_ text = decode_id3v2_text(data, len);
+			if(is_title)
+				md.title = clean_tag_text(text);
+			else
+				md.track_number = stoi(text, -1);
+		}
+		offset += size;
+	}
+}
+
+static void parse_vorbis_comments(const u8 *data, size_t len, TrackMetadata &md)
+{
+	const u8 *p = data;
+	const u8 *end = data + len;
+	if(p + 4 > end)
+		return;
+	p += 4 + (u64)le32(p); // Vendor string
+	if(p + 4 > end)
+		return;
+	u32 count = le32(p);
+	p += 4;
+	for(u32 i=0; i<count && p + 4 <= end; i++){
+		u32 comment_len = le32(p);
+		p += 4;
+		if(comment_len > (size_t)(end - p))
+			break; // Truncated
+		ss_ comment((const char*)p, comment_len);
+		p += comment_len;
+		size_t eq_i = comment.find('=');
+		if(eq_i == ss_::npos)
+			continue;
+		ss_ key = comment.substr(0, eq_i);
+		for(size_t j=0; j<key.size(); j++)
+			key[j] = toupper(key[j]);
+		if(key == "TITLE" && md.title == "")
+			md.title = clean_tag_text(comment.substr(eq_i + 1));
+		else if(key == "TRACKNUMBER" && md.track_number == -1)
+			md.track_number = stoi(comment.substr(eq_i + 1), -1);
+	}
+}
+
+// Returns the body range of the first child atom of the given type
+static bool find_mp4_atom(ProbeFile &f, u64 start, u64 end, const char *type,
+		u64 &body_start, u64 &body_end)
+{
+	u64 offset = start;
+	for(int i=0; i<1000 && offset + 8 <= end; i++){
+		u8 h[16];
+		if(f.read_at(offset, h, 16) < 8)
+			return false;
+		u64 atom_size = be32(h);
+		u64 header_size = 8;
+		if(atom_size == 1){
+			atom_size = be64(h + 8);
+			header_size = 16;
+		} else if(atom_size == 0){
+			atom_size = end - offset;
+		}
+		if(atom_size < header_size || offset + atom_size > end)
+			return false;
+		if(memcmp(h + 4, type, 4) == 0){
+			body_start = offset + header_size;
+			body_end = offset + atom_size;
+			return true;
+		}
+		offset += atom_size;
+	}
+	return false;
+}
+
+static void parse_mp4_tags(ProbeFile &f, u64 moov_start, u64 moov_end,
+		TrackMetadata &md)
+{
+	u64 s, e;
+	if(!find_mp4_atom(f, moov_start, moov_end, "udta", s, e) ||
+			!find_mp4_atom(f, s, e, "meta", s, e) ||
+			!find_mp4_atom(f, s + 4, e, "ilst", s, e)) // meta has version and flags
+		return;
+	u64 ilst_start = s;
+	u64 ilst_end = e;
+	if(find_mp4_atom(f, ilst_start, ilst_end, "\xa9nam", s, e) &&
+			find_mp4_atom(f, s, e, "data", s, e) && e - s > 8 && e - s < 1024){
+		char buf[1024];
+		size_t len = f.read_at(s + 8, buf, e - s - 8); // Skip type and locale
+		md.title = clean_tag_text(ss_(buf, len));
+	}
+	if(find_mp4_atom(f, ilst_start, ilst_end, "trkn", s, e) &&
+			find_mp4_atom(f, s, e, "data", s, e)){
+		u8 buf[12];
+		if(f.read_at(s, buf, 12) == 12)
+			md.track_number = be16(buf + 10);
+	}
+}
+
+static bool probe_flac(ProbeFile &f, u64 start, TrackMetadata &md)
+{
+	u8 h[4 + 4 + 34];
+	if(f.read_at(start, h, sizeof h) != sizeof h || memcmp(h, "fLaC", 4) != 0)
+		return false;
+	if((h[4] & 0x7f) != 0) // First block has to be STREAMINFO
+		return false;
+	const u8 *si = h + 8;
+	u32 sample_rate = (si[10] << 12) | (si[11] << 4) | (si[12] >> 4);
+	u64 total_samples = ((u64)(si[13] & 0x0f) << 32) | be32(si + 14);
+	md.sample_rate = sample_rate;
+	if(sample_rate != 0)
+		md.duration = (double)total_samples / sample_rate;
+
+	// Find VORBIS_COMMENT by reading only the headers of other blocks
+	u64 offset = start + 4;
+	for(int i=0; i<64; i++){
+		u8 bh[4];
+		if(f.read_at(offset, bh, 4) != 4)
+			break;
+		u32 len = (bh[1] << 16) | (bh[2] << 8) | bh[3];
+		if((bh[0] & 0x7f) == 4){
+			u8 buf[65536];
+			size_t got = f.read_at(offset + 4, buf, len < sizeof buf ? len : sizeof buf);
+			parse_vorbis_comments(buf, got, md);
+			break;
+		}
+		if(bh[0] & 0x80)
+			break; // Last block
+		offset += 4 + len;
+	}
+	return true;
+}
+
+static bool probe_wav(ProbeFile &f, TrackMetadata &md)
+{
+	u8 h[12];
+	if(f.read_at(0, h, 12) != 12 || memcmp(h, "RIFF", 4) != 0 ||
+			memcmp(h + 8, "WAVE", 4) != 0)
+		return false;
+	u32 byte_rate = 0;
+	u64 offset = 12;
+	for(int i=0; i<32; i++){
+		u8 ch[8 + 12];
+		if(f.read_at(offset, ch, sizeof ch) < 8)
+			break;
+		u32 chunk_size = le32(ch + 4);
+		if(memcmp(ch, "fmt ", 4) == 0){
+			md.sample_rate = le32(ch + 8 + 4);
+			byte_rate = le32(ch + 8 + 8);
+		} else if(memcmp(ch, "data", 4) == 0){
+			if(byte_rate != 0)
+				md.duration = (double)chunk_size / byte_rate;
+			return true;
+		}
+		offset += 8 + chunk_size + (chunk_size & 1);
+	}
+	return byte_rate != 0;
+}
+
+static bool probe_mp3(ProbeFile &f, u64 start, TrackMetadata &md)
+{
+	static const u16 bitrates[5][15] = {
+		{0,32,64,96,128,160,192,224,256,288,320,352,384,416,448}, // V1 L1
+		{0,32,48,56,64,80,96,112,128,160,192,224,256,320,384}, // V1 L2
+		{0,32,40,48,56,64,80,96,112,128,160,192,224,256,320}, // V1 L3
+		{0,32,48,56,64,80,96,112,128,144,160,176,192,224,256}, // V2 L1
+		{0,8,16,24,32,40,48,56,64,80,96,112,128,144,160}, // V2 L2 & L3
+	};
+	static const u32 sample_rates[3] = {44100, 48000, 32000};
+
+	u8 buf[4096];
+	size_t len = f.read_at(start, buf, sizeof buf);
+	for(size_t i=0; i+4<=len; i++){
+		if(buf[i] != 0xff || (buf[i+1] & 0xe0) != 0xe0)
+			continue;
+		int version = (buf[i+1] >> 3) & 3; // 3=V1, 2=V2, 0=V2.5
+		int layer = (buf[i+1] >> 1) & 3; // 3=L1, 2=L2, 1=L3
+		int bitrate_i = buf[i+2] >> 4;
+		int sample_rate_i = (buf[i+2] >> 2) & 3;
+		if(version == 1 || layer == 0 || bitrate_i == 0 || bitrate_i == 15 ||
+				sample_rate_i == 3)
+			continue;
+		bool v1 = (version == 3);
+		bool mono = (buf[i+3] >> 6) == 3;
+		int table_i = v1 ? 3 - layer : (layer == 3 ? 3 : 4);
+		u32 bitrate = bitrates[table_i][bitrate_i] * 1000;
+		u32 sample_rate = sample_rates[sample_rate_i] >> (version == 3 ? 0 :
+				version == 2 ? 1 : 2);
+		u32 samples_per_frame = layer == 3 ? 384 : (layer == 2 || v1) ? 1152 : 576;
+		md.sample_rate = sample_rate;
+
+		// VBR files have the number of frames in a Xing/Info or VBRI header
+		u8 vh[18];
+		size_t xing_offset = v1 ? (mono ? 21 : 36) : (mono ? 13 : 21);
+		if(f.read_at(start + i + xing_offset, vh, 12) == 12 &&
+				(memcmp(vh, "Xing", 4) == 0 || memcmp(vh, "Info", 4) == 0) &&
+				(be32(vh + 4) & 1)){
+			md.duration = (double)be32(vh + 8) * samples_per_frame / sample_rate;
+			return true;
+		}
+		if(f.read_at(start + i + 36, vh, 18) == 18 && memcmp(vh, "VBRI", 4) == 0){
+			md.duration = (double)be32(vh + 14) * samples_per_frame / sample_rate;
+			return true;
+		}
+		// Assume constant bitrate
+		md.duration = (double)(f.size - start - i) * 8 / bitrate;
+		return true;
+	}
+	return false;
+}
+
+static bool probe_ogg(ProbeFile &f, TrackMetadata &md)
+{
+	u8 h[27 + 255 + 20];
+	size_t len = f.read_at(0, h, sizeof h);
+	if(len < 27 || memcmp(h, "OggS", 4) != 0)
+		return false;
+	u32 serial = le32(h + 14);
+	size_t packet_i = 27 + h[26];
+	if(packet_i + 20 > len)
+		return false;
+	const u8 *packet = h + packet_i;
+	u32 sample_rate = 0;
+	u64 pre_skip = 0;
+	bool opus = false;
+	if(memcmp(packet, "\x01vorbis", 7) == 0){
+		sample_rate = le32(packet + 12);
+	} else if(memcmp(packet, "OpusHead", 8) == 0){
+		sample_rate = 48000; // Opus granule positions are always at 48kHz
+		pre_skip = le16(packet + 10);
+		md.sample_rate = le32(packet + 12);
+		opus = true;
+	} else {
+		return false;
+	}
+
+	// The second packet of the stream contains the comments
+	{
+		u8 head[65536];
+		size_t head_len = f.read_at(0, head, sizeof head);
+		sv_<u8> comment_packet;
+		size_t packet_i = 0;
+		size_t page_i = 0;
+		while(packet_i < 2 && page_i + 27 <= head_len &&
+				memcmp(head + page_i, "OggS", 4) == 0){
+			size_t num_segments = head[page_i + 26];
+			const u8 *segments = head + page_i + 27;
+			size_t data_i = page_i + 27 + num_segments;
+			if(data_i > head_len)
+				break;
+			for(size_t i=0; i<num_segments && packet_i < 2; i++){
+				// The rest of the packet is past head; parse what we have
+				if(data_i >= head_len)
+					break;
+				size_t seg_len = segments[i];
+				if(le32(head + page_i + 14) == serial && packet_i == 1){
+					size_t n = data_i + seg_len <= head_len ? seg_len : head_len - data_i;
+					comment_packet.insert(comment_packet.end(),
+							head + data_i, head + data_i + n);
+				}
+				data_i += seg_len;
+				if(seg_len < 255 && le32(head + page_i + 14) == serial)
+					packet_i++;
+			}
+			page_i = data_i;
+		}
+		size_t magic_len = opus ? 8 : 7;
+		if(comment_packet.size() > magic_len){
+			parse_vorbis_comments(&comment_packet[magic_len],
+					comment_packet.size() - magic_len, md);
+		}
+	}
+	if(md.sample_rate == 0)
+		md.sample_rate = sample_rate;
+	if(sample_rate == 0)
+		return true;
+
+	// The granule position of the last page is the total number of samples
+	u8 tail[65536];
+	u64 tail_start = f.size > sizeof tail ? f.size - sizeof tail : 0;
+	size_t tail_len = f.read_at(tail_start, tail, sizeof tail);
+	for(size_t i=tail_len >= 27 ? tail_len - 27 : 0; i != (size_t)-1; i--){
+		if(memcmp(tail + i, "OggS", 4) != 0 || tail[i+4] != 0 ||
+				le32(tail + i + 14) != serial)
+			continue;
+		u64 granule = le64(tail + i + 6);
+		if(granule == (u64)-1 || granule < pre_skip)
+			continue;
+		md.duration = (double)(granule - pre_skip) / sample_rate;
+		break;
+	}
+	return true;
+}
+
+static bool probe_mp4(ProbeFile &f, TrackMetadata &md)
+{
+	u8 h[8];
+	if(f.read_at(0, h, 8) != 8 || memcmp(h + 4, "ftyp", 4) != 0)
+		return false;
+	u64 moov_start, moov_end, s, e;
+	if(!find_mp4_atom(f, 0, f.size, "moov", moov_start, moov_end))
+		return true;
+	u8 mvhd[36];
+	if(find_mp4_atom(f, moov_start, moov_end, "mvhd", s, e) &&
+			f.read_at(s, mvhd, 36) == 36){
+		u32 timescale;
+		u64 duration;
+		if(mvhd[0] == 1){
+			timescale = be32(mvhd + 20);
+			duration = be64(mvhd + 24);
+		} else {
+			timescale = be32(mvhd + 12);
+			duration = be32(mvhd + 16);
+		}
+		if(timescale != 0)
+			md.duration = (double)duration / timescale;
+	}
+	parse_mp4_tags(f, moov_start, moov_end, md);
+	return true;
+}
+
+bool probe_metadata(const ss_ &path, TrackMetadata &result)
+{
+	ProbeFile f(path);
+	if(f.fd == -1)
+		return false;
+	ss_ ext;
+	size_t dot_i = path.rfind('.');
+	if(dot_i != ss_::npos){
+		ext = path.substr(dot_i + 1);
+		for(size_t i=0; i<ext.size(); i++)
+			ext[i] = tolower(ext[i]);
+	}
+	TrackMetadata md;
+	parse_id3v2(f, md);
+	u64 start = skip_id3v2(f);
+	bool found = probe_flac(f, start, md) || probe_wav(f, md) ||
+			probe_ogg(f, md) || probe_mp4(f, md);
+	if(!found && (ext == "mp3" || ext == "mp2" || ext == "mpga"))
+		found = probe_mp3(f, start, md);
+	if(!found)
+		return false;
+	result = md;
+	return true;
+}
+
+namespace metadata_cache {
+
+struct Entry {
+	u64 size = 0;
+	s64 mtime = 0;
+	TrackMetadata md;
+};
+
+static std::mutex mutex;
+static std::condition_variable queue_cv;
+static std::deque<ss_> queue;
+static set_<ss_> queued_paths; // Same as in queue
+static int num_probing = 0; // Popped from queue but not processed yet
+static std::condition_variable idle_cv; // Notified when num_probing drops to 0
+static sm_<ss_, Entry> entries;
+static sv_<ss_> completed;
+static bool dirty = false;
+static bool stop_requested = false;
+static sv_<std::thread> workers;
+
+static void process(const ss_ &path)
+{
+	struct stat st;
+	if(stat(path.c_str(), &st) != 0)
+		return;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = entries.find(path);
+		if(it != entries.end() && it->second.size == (u64)st.st_size &&
+				it->second.mtime == (s64)st.st_mtime)
+			return;
+	}
+	Entry entry;
+	entry.size = st.st_size;
+	entry.mtime = st.st_mtime;
+	probe_metadata(path, entry.md); // Cache failures too
+	std::lock_guard<std::mutex> lock(mutex);
+	entries[path] = entry;
+	completed.push_back(path);
+	dirty = true;
+}
+
+static void worker_main()
+{
+	for(;;){
+		ss_ path;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			while(queue.empty() && !stop_requested)
+				queue_cv.wait(lock);
+			if(stop_requested)
+				return;
+			path = queue.front();
+			queue.pop_front();
+			queued_paths.erase(path);
+			num_probing++;
+		}
+		process(path);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			num_probing--;
+		}
+		idle_cv.notify_all();
+	}
+}
+
+bool load(const ss_ &path)
+{
+	ss_ data;
+	if(!read_file_content(path, data))
+		return false;
+	std::lock_guard<std::mutex> lock(mutex);
+	Strfnd f(data);
+	while(!f.atend()){
+		Strfnd fl(f.next("\n"));
+		Entry entry;
+		entry.size = strtoull(fl.next("\t").c_str(), NULL, 10);
+		entry.mtime = strtoll(fl.next("\t").c_str(), NULL, 10);
+		entry.md.duration = stof(fl.next("\t"), 0.0);
+		entry.md.sample_rate = stoi(fl.next("\t"), 0);
+		entry.md.track_number = stoi(fl.next("\t"), -1);
+		entry.md.title = fl.next("\t");
+		ss_ file_path = fl.next("");
+		if(file_path != "")
+			entries[file_path] = entry;
+	}
+	return true;
+}
+
+void save(const ss_ &path)
+{
+	ss_ blob;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if(!dirty)
+			return;
+		dirty = false;
+		char buf[100];
+		for(auto &pair : entries){
+			const Entry &e = pair.second;
+			snprintf(buf, sizeof buf, "%" PRIu64 "\t%" PRId64 "\t%.3f\t%i\t%i\t",
+					e.size, e.mtime, e.md.duration, e.md.sample_rate,
+					e.md.track_number);
+			blob += buf + e.md.title + "\t" + pair.first + "\n";
+		}
+	}
+	std::ofstream f(path.c_str(), std::ios::binary);
+	f<<blob;
+}
+
+void start()
+{
+	if(!workers.empty())
+		return;
+	stop_requested = false;
+	// Mostly waiting for I/O; a few threads keep slow media busy
+	size_t num_workers = std::thread::hardware_concurrency();
+	if(num_workers < 2)
+		num_workers = 2;
+	if(num_workers > 4)
+		num_workers = 4;
+	for(size_t i=0; i<num_workers; i++)
+		workers.push_back(std::thread(worker_main));
+	static bool atexit_registered = false;
+	if(!atexit_registered){
+		atexit(stop);
+		atexit_registered = true;
+	}
+}
+
+void stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stop_requested = true;
+	}
+	queue_cv.notify_all();
+	for(std::thread &worker : workers)
+		worker.join();
+	workers.clear();
+}
+
+void queue_probe(const ss_ &path, bool urgent)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if(!queued_paths.insert(path).second){
+			if(!urgent)
+				return;
+			// Move it to the front
+			for(auto it = queue.begin(); it != queue.end(); ++it){
+				if(*it == path){
+					queue.erase(it);
+					break;
+				}
+			}
+		}
+		if(urgent)
+			queue.push_front(path);
+		else
+			queue.push_back(path);
+	}
+	queue_cv.notify_one();
+}
+
+void clear()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	queue.clear();
+	queued_paths.clear();
+	idle_cv.wait(lock, []{ return num_probing == 0; });
+}
+
+bool get(const ss_ &path, TrackMetadata &result)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = entries.find(path);
+	if(it == entries.end())
+		return false;
+	result = it->second.md;
+	return true;
+}
+
+sv_<ss_> pop_completed()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	sv_<ss_> result;
+	result.swap(completed);
+	return result;
+}
+
+} // namespace metadata_cache
@@ -0,0 +1,33 @@
+#pragma once
+#include "types.hpp"
+
+struct TrackMetadata
+{
+	double duration = 0; // Seconds; 0 = unknown
+	int sample_rate = 0; // 0 = unknown
+	int track_number = -1; // From tags; -1 = unknown
+	ss_ title; // From tags; empty = unknown
+};
+
+// Reads only the headers of a file; returns false if nothing was found
+bool probe_metadata(const ss_ &path, TrackMetadata &result);
+
+// Metadata of media files is probed by a pool of background threads and
+// cached persistently, keyed by path, size and modification time.
+namespace metadata_cache
+{
+	bool load(const ss_ &path);
+	// Does nothing if nothing has changed since the last save
+	void save(const ss_ &path);
+	void start();
+	void stop();
+	// Files already in the cache are only re-checked for size and mtime.
+	// Urgent files are probed before anything else that is queued.
+	void queue_probe(const ss_ &path, bool urgent=false);
+	// Drops everything queued and waits for probes in progress to finish
+	// (eg. before unmounting)
+	void clear();
+	bool get(const ss_ &path, TrackMetadata &result);
+	// Returns paths of files that got new metadata since the last call
+	sv_<ss_> pop_completed();
+};
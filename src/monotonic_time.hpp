@@ -0,0 +1,11 @@
+#pragma once
+#include <chrono>
+#include <stdint.h>
+
+// Milliseconds since an arbitrary point. Unlike time(0), this isn't affected
+// by wall clock changes (eg. NTP sync after boot).
+static int64_t get_monotonic_ms()
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+}
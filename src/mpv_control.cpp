@@ -9,18 +9,25 @@
 #include "ui.hpp"
 #include "print.hpp"
 #include "library.hpp"
+#include "media_types.hpp"
 #include "play_cursor.hpp"
+#include "play_history.hpp"
+#include "metadata.hpp"
+#include "prefetch.hpp"
+#include "transcode_cache.hpp"
 #include "arduino_global.hpp"
 #include "ui_output_queue.hpp"
+#include "monotonic_time.hpp"
 #include "../common/common.hpp"
 #include <mpv/client.h>
+#include <math.h>
 #ifdef __WIN32__
 #  include "windows_includes.hpp"
 #else
 #  include <unistd.h>
 #endif
 
-void after_mpv_loadfile(double start_pos, const ss_ &track_name, const ss_ &album_name);
+void after_mpv_loadfile(double start_pos, const Track &track, const ss_ &album_name);
 void load_and_play_current_track_from_start();
 void eat_all_mpv_events();
 void wait_mpv_event(int event_id, int max_ms);
@@ -32,12 +39,147 @@ bool track_was_loaded = false;
 time_t mpv_last_not_idle_timestamp = 0;
 time_t mpv_last_loadfile_timestamp = 0;
 
-void after_mpv_loadfile(double start_pos, const ss_ &track_name, const ss_ &album_name)
+// What the firmware was last told with >TRACK. It extrapolates the progress
+// bar from this by itself, so this is resent only when it is off by more than
+// TRACK_TIMING_MAX_DRIFT_S.
+struct SentTrackTiming {
+	double duration = 0;
+	double position = 0;
+	bool playing = false;
+	int64_t sent_ms = 0;
+};
+static SentTrackTiming sent_track_timing;
+static bool track_timing_dirty = true;
+static const double TRACK_TIMING_MAX_DRIFT_S = 1.0;
+
+void invalidate_track_timing()
 {
+	track_timing_dirty = true;
+}
+
+static void update_firmware_track_timing(double time_pos, bool force)
+{
+	SentTrackTiming &sent = sent_track_timing;
+	bool playing = current_cursor.current_pause_mode == PM_PLAY;
+	int64_t now = get_monotonic_ms();
+	if(!force && sent.duration == current_cursor.duration &&
+			sent.playing == playing){
+		double expected_pos = sent.position;
+		if(playing)
+			expected_pos += (now - sent.sent_ms) / 1000.0;
+		if(fabs(expected_pos - time_pos) < TRACK_TIMING_MAX_DRIFT_S)
+			return;
+	}
+	sent.duration = current_cursor.duration;
+	sent.position = time_pos;
+	sent.playing = playing;
+	sent.sent_ms = now;
+	arduino_serial_write(">TRACK:"+itos(sent.duration * 1000)+":"+
+			itos(sent.position * 1000)+":"+(playing ? "1" : "0")+"\r\n");
+}
+
+static void prefetch_next_track()
+{
+	if(current_media_content.albums.empty())
+		return;
+	PlayCursor next = current_cursor;
+	if(next.track_progress_mode != TPM_ALBUM_REPEAT_TRACK){
+		next.track_seq_i++;
+		cursor_bound_wrap(current_media_content, next);
+	}
+	prefetch::set_next(get_track(current_media_content, next).path);
+}
+
+static const int TRANSCODE_LOOKAHEAD = 4;
+
+static void queue_upcoming_transcodes()
+{
+	if(current_media_content.albums.empty())
+		return;
+	sv_<Track> upcoming;
+	PlayCursor next = current_cursor;
+	for(int i=0; i<TRANSCODE_LOOKAHEAD; i++){
+		if(next.track_progress_mode != TPM_ALBUM_REPEAT_TRACK){
+			next.track_seq_i++;
+			cursor_bound_wrap(current_media_content, next);
+		}
+		upcoming.push_back(get_track(current_media_content, next));
+	}
+	// The most recently queued one is transcoded first
+	for(auto it = upcoming.rbegin(); it != upcoming.rend(); ++it)
+		transcode_cache::queue(it->path, it->media_type);
+}
+
+// What was last given to mpv; the path differs from the track's path if a
+// transcoded copy is played
+static ss_ mpv_loaded_track_path;
+static ss_ mpv_loaded_path;
+
+// Replaces the playing file with the track, or its transcoded copy
+static void mpv_loadfile(const Track &track)
+{
+	ss_ path = transcode_cache::get_playable_path(track.path);
+	mpv_loaded_track_path = track.path;
+	mpv_loaded_path = path;
+	if(path != track.path && LOG_DEBUG)
+		printf_("Playing transcoded copy %s\n", cs(path));
+	// The copies are plain audio
+	const char *options = path == track.path ?
+			media_type_mpv_file_options(track.media_type) : "";
+	if(options[0] != 0){
+		// Named arguments because the position of the options argument
+		// depends on the mpv version
+		const char *keys[] = {"name", "url", "options"};
+		const char *values[] = {"loadfile", path.c_str(), options};
+		mpv_node nodes[3];
+		for(int i=0; i<3; i++){
+			nodes[i].format = MPV_FORMAT_STRING;
+			nodes[i].u.string = (char*)values[i];
+		}
+		mpv_node_list list;
+		list.num = 3;
+		list.values = nodes;
+		list.keys = (char**)keys;
+		mpv_node args;
+		args.format = MPV_FORMAT_NODE_MAP;
+		args.u.list = &list;
+		mpv_node result;
+		int status = mpv_command_node(mpv, &args, &result);
+		if(status >= 0){
+			mpv_free_node_contents(&result);
+			return;
+		}
+		static bool warned = false;
+		if(!warned){
+			warned = true;
+			printf_("WARNING: loadfile with options \"%s\" failed (%s); "
+					"loading without them.\n", options, mpv_error_string(status));
+		}
+	}
+	const char *cmd[] = {"loadfile", path.c_str(), NULL};
+	check_mpv_error(mpv_command(mpv, cmd));
+}
+
+void after_mpv_loadfile(double start_pos, const Track &track, const ss_ &album_name)
+{
+	const ss_ &track_name = track.display_name;
+
 	mpv_last_loadfile_timestamp = time(0);
 
 	current_cursor.stream_end = 0; // Will be filled in at time-pos getter code or something
 
+	// Known right away if the track has been probed; otherwise filled in when
+	// mpv has loaded the file
+	TrackMetadata md;
+	current_cursor.duration = 0;
+	if(metadata_cache::get(track.path, md))
+		current_cursor.duration = md.duration;
+
+	// Resuming a track doesn't count as a new play
+	if(start_pos < 0.001)
+		play_history_record(current_play_history, album_name,
+				get_track_history_name(track));
+
 	if(current_cursor.track_name != track_name){
 		printf_("WARNING: Changing track name at loadfile to \"%s\"\n",
 				cs(track_name));
@@ -46,6 +188,10 @@ void after_mpv_loadfile(double start_pos, const ss_ &track_name, const ss_ &albu
 	}
 
 	arduino_serial_write(">PROGRESS:0\r\n");
+	invalidate_track_timing();
+
+	prefetch_next_track();
+	queue_upcoming_transcodes();
 }
 
 void check_mpv_error(int status)
@@ -83,10 +229,9 @@ void force_start_at_cursor()
 
 	eat_all_mpv_events();
 
-	const char *cmd[] = {"loadfile", track.path.c_str(), NULL};
-	check_mpv_error(mpv_command(mpv, cmd));
+	mpv_loadfile(track);
 
-	after_mpv_loadfile(current_cursor.time_pos, track.display_name,
+	after_mpv_loadfile(current_cursor.time_pos, track,
 			get_album_name(current_media_content, current_cursor));
 
 	// Wait for the start-file event
@@ -133,10 +278,9 @@ void load_and_play_current_track_from_start()
 	mpv_set_option_string(mpv, "start", "#1");
 
 	// Play the file
-	const char *cmd[] = {"loadfile", track.path.c_str(), NULL};
-	check_mpv_error(mpv_command(mpv, cmd));
+	mpv_loadfile(track);
 
-	after_mpv_loadfile(0, track.display_name,
+	after_mpv_loadfile(0, track,
 			get_album_name(current_media_content, current_cursor));
 
 	//update_and_show_default_display();
@@ -161,7 +305,10 @@ void refresh_track()
 		current_cursor.track_name = track.display_name;
 		current_cursor.album_name = get_album_name(current_media_content, current_cursor);
 
-		if(playing_path == NULL || ss_(playing_path) != track.path){
+		bool playing_track = playing_path != NULL && (ss_(playing_path) == track.path ||
+				(ss_(playing_path) == mpv_loaded_path &&
+				mpv_loaded_track_path == track.path));
+		if(!playing_track){
 			printf_("Playing path does not match current track; Switching track.\n");
 
 			load_and_play_current_track_from_start();
@@ -232,6 +379,8 @@ void automated_start_play_next_track()
 	case TPM_SMART_TRACK_SHUFFLE:
 	case TPM_SMART_ALBUM_SHUFFLE:
 	case TPM_MR_SHUFFLE:
+	case TPM_WEIGHTED_SHUFFLE:
+	case TPM_GLOBAL_SHUFFLE:
 		current_cursor.track_seq_i++;
 		current_cursor.time_pos = 0;
 		current_cursor.stream_pos = 0;
@@ -306,6 +455,10 @@ void handle_mpv()
 		if(event->event_id == MPV_EVENT_IDLE){
 			do_something_instead_of_idle();
 		}
+		if(event->event_id == MPV_EVENT_PLAYBACK_RESTART){
+			// Playback continues from a new position after a seek
+			invalidate_track_timing();
+		}
 		if(event->event_id == MPV_EVENT_FILE_LOADED){
 			track_was_loaded = true;
 			if(current_cursor.stream_end == 0){
@@ -318,6 +471,11 @@ void handle_mpv()
 							current_cursor.stream_end);
 				}
 			}
+			if(current_cursor.duration == 0){
+				double duration = 0;
+				mpv_get_property(mpv, "duration", MPV_FORMAT_DOUBLE, &duration);
+				current_cursor.duration = duration;
+			}
 			if(queued_pause){
 				queued_pause = false;
 				if(LOG_DEBUG)
@@ -325,6 +483,7 @@ void handle_mpv()
 				check_mpv_error(mpv_command_string(mpv, "pause"));
 				ui_output_queue::push_message("PAUSE");
 				current_cursor.current_pause_mode = PM_PAUSE;
+				invalidate_track_timing();
 				arduino_set_extra_segments();
 				printf_("Paused.\n");
 			}
@@ -332,8 +491,11 @@ void handle_mpv()
 	}
 
 	static time_t last_time_pos_get_timestamp = 0;
-	if(last_time_pos_get_timestamp != time(0)){
+	if(last_time_pos_get_timestamp != time(0) || track_timing_dirty){
 		last_time_pos_get_timestamp = time(0);
+		// If this doesn't get sent now, the drift check catches it later
+		bool force_track_timing = track_timing_dirty;
+		track_timing_dirty = false;
 
 		int64_t stream_pos = 0;
 		mpv_get_property(mpv, "stream-pos", MPV_FORMAT_INT64, &stream_pos);
@@ -354,9 +516,13 @@ void handle_mpv()
 						current_cursor.stream_end);
 			}
 
-			if(!minimize_display_updates || time(0) % 10 == 0){
-				arduino_serial_write(">PROGRESS:"+
-						itos(stream_pos * 255 / current_cursor.stream_end)+"\r\n");
+			if(arduino_firmware_caps.count("TRACK") && current_cursor.duration > 0){
+				update_firmware_track_timing(time_pos, force_track_timing);
+			} else {
+				int progress = get_cursor_progress_255(current_cursor);
+				if(progress != -1 && (!minimize_display_updates || time(0) % 10 == 0)){
+					arduino_serial_write(">PROGRESS:"+itos(progress)+"\r\n");
+				}
 			}
 
 			// Reset starting position so that if this track is being looped, it
@@ -8,4 +8,6 @@ void refresh_track();
 void start_at_relative_track(int album_add, int track_add, bool force_show_album=false);
 void wait_until_mpv_idle();
 void handle_mpv();
+// Makes handle_mpv() send the current position and play state to the firmware
+void invalidate_track_timing();
 
@@ -2,7 +2,7 @@
 #include "stuff2.hpp"
 #include "print.hpp"
 
-extern sv_<size_t> queued_album_shuffled_track_order;
+extern sv_<u32> queued_album_shuffled_track_order;
 
 enum TrackProgressMode {
 	TPM_NORMAL,
@@ -13,6 +13,8 @@ enum TrackProgressMode {
 	TPM_SMART_ALBUM_SHUFFLE, // Tracks shuffled when appropriate, albums always shuffled
 	TPM_SMART_TRACK_SHUFFLE, // Tracks shuffled when appropriate, albums not shuffled
 	TPM_MR_SHUFFLE, // Albums shuffled in groups of 5
+	TPM_WEIGHTED_SHUFFLE, // Like smart album shuffle but avoids recently played
+	TPM_GLOBAL_SHUFFLE, // All tracks of all albums in one shuffled order
 
 	TPM_NUM_MODES,
 };
@@ -28,11 +30,19 @@ static const char* tpm_to_string(TrackProgressMode m)
 	case TPM_SMART_ALBUM_SHUFFLE: return "SMART ALBUM SHUFFLE";
 	case TPM_SMART_TRACK_SHUFFLE: return "SMART TRACK SHUFFLE";
 	case TPM_MR_SHUFFLE:          return "MR. SHUFFLE";
+	case TPM_WEIGHTED_SHUFFLE:    return "WEIGHTED SHUFFLE";
+	case TPM_GLOBAL_SHUFFLE:      return "GLOBAL SHUFFLE";
 	case TPM_NUM_MODES:           return "INVALID";
 	}
 	return "INVALID";
 }
 
+// The kind of track order used by shuffled albums in the mode
+static TrackOrderKind tpm_track_order_kind(TrackProgressMode m)
+{
+	return m == TPM_WEIGHTED_SHUFFLE ? TOK_WEIGHTED : TOK_SHUFFLED;
+}
+
 enum PauseMode {
 	PM_PLAY,
 	PM_PAUSE,
@@ -51,9 +61,34 @@ public:
 	double time_pos = 0;
 	int64_t stream_pos = 0;
 	int64_t stream_end = 0;
+	double duration = 0; // Seconds; 0 = unknown
 	ss_ track_name;
 	ss_ album_name;
 
+	// In TPM_GLOBAL_SHUFFLE the cursor is a position in a permutation of all
+	// tracks. album_seq_i and track_seq_i split that position the same way
+	// the library splits tracks into albums, so that stepping and wrapping
+	// work like in the other modes.
+	size_t global_seq_i(const MediaContent &mc) const {
+		return get_global_track_index(mc, album_seq_i, track_seq_i);
+	}
+
+	void set_global_seq_i(const MediaContent &mc, size_t i) {
+		size_t album_seq_i1, track_seq_i1;
+		split_global_track_index(mc, i, album_seq_i1, track_seq_i1);
+		album_seq_i = album_seq_i1;
+		track_seq_i = track_seq_i1;
+	}
+
+	// The number of valid track_seq_i values at album_seq_i
+	int seq_album_size(const MediaContent &mc) const {
+		if(mc.albums.empty())
+			return 0;
+		if(track_progress_mode == TPM_GLOBAL_SHUFFLE)
+			return mc.albums[album_seq_i].tracks.size();
+		return mc.albums[album_i(mc)].tracks.size();
+	}
+
 	int album_i(const MediaContent &mc) const {
 		if(mc.albums.empty())
 			return 0;
@@ -66,6 +101,18 @@ public:
 			return mc.shuffled_album_order[album_seq_i];
 		} else if(track_progress_mode == TPM_MR_SHUFFLE){
 			return mc.mr_shuffled_album_order[album_seq_i];
+		} else if(track_progress_mode == TPM_WEIGHTED_SHUFFLE){
+			return mc.weighted_album_order[album_seq_i];
+		} else if(track_progress_mode == TPM_GLOBAL_SHUFFLE){
+			if(track_seq_i < 0 || track_seq_i >= seq_album_size(mc)){
+				printf_("track_seq_i overflow\n");
+				return 0;
+			}
+			size_t album_i1, track_i1;
+			split_global_track_index(mc,
+					get_global_track_order(mc).forward(global_seq_i(mc)),
+					album_i1, track_i1);
+			return album_i1;
 		} else {
 			return album_seq_i;
 		}
@@ -74,26 +121,32 @@ public:
 	int track_i(const MediaContent &mc) const {
 		if(mc.albums.empty())
 			return 0;
-		const Album &album = mc.albums[album_i(mc)];
-		if(album.tracks.empty())
-			return 0;
-		if(track_seq_i < 0 || track_seq_i >= (int)album.tracks.size()){
-			printf_("track_seq_i overflow\n");
+		if(track_seq_i < 0 || track_seq_i >= seq_album_size(mc)){
+			if(seq_album_size(mc) != 0)
+				printf_("track_seq_i overflow\n");
 			return 0;
 		}
+		if(track_progress_mode == TPM_GLOBAL_SHUFFLE){
+			size_t album_i1, track_i1;
+			split_global_track_index(mc,
+					get_global_track_order(mc).forward(global_seq_i(mc)),
+					album_i1, track_i1);
+			return track_i1;
+		}
+		const Album &album = mc.albums[album_i(mc)];
 		if(track_progress_mode == TPM_SHUFFLE_ALL ||
 				track_progress_mode == TPM_SHUFFLE_TRACKS){
-			if(album.shuffled_track_order.size() != album.tracks.size())
-				create_shuffled_order(album.shuffled_track_order, album.tracks.size());
-			return album.shuffled_track_order[track_seq_i];
+			return get_shuffled_track_order(mc, album_i(mc))[track_seq_i];
 		} else if(track_progress_mode == TPM_MR_SHUFFLE ||
 				track_progress_mode == TPM_SMART_TRACK_SHUFFLE ||
 				track_progress_mode == TPM_SMART_ALBUM_SHUFFLE){
 			if(!album.shuffle_tracks_in_smart_mode)
 				return track_seq_i;
-			if(album.shuffled_track_order.size() != album.tracks.size())
-				create_shuffled_order(album.shuffled_track_order, album.tracks.size());
-			return album.shuffled_track_order[track_seq_i];
+			return get_shuffled_track_order(mc, album_i(mc))[track_seq_i];
+		} else if(track_progress_mode == TPM_WEIGHTED_SHUFFLE){
+			if(!album.shuffle_tracks_in_smart_mode)
+				return track_seq_i;
+			return get_weighted_track_order(mc, album_i(mc))[track_seq_i];
 		} else {
 			return track_seq_i;
 		}
@@ -118,13 +171,13 @@ public:
 			printf_("WARNING: set_track_seq_i: No albums\n");
 			return;
 		}
-		const Album &album = mc.albums[album_i(mc)];
+		int size = seq_album_size(mc);
 		if(new_track_seq_i < 0){
 			printf_("WARNING: new_track_seq_i < 0\n");
 			track_seq_i = 0;
-		} else if(new_track_seq_i >= (int)album.tracks.size()){
+		} else if(new_track_seq_i >= size){
 			printf_("WARNING: new_track_seq_i >= album.tracks.size()\n");
-			track_seq_i = album.tracks.size() - 1;
+			track_seq_i = size - 1;
 		} else {
 			track_seq_i = new_track_seq_i;
 		}
@@ -154,6 +207,24 @@ public:
 			}
 			return;
 		}
+		case TPM_WEIGHTED_SHUFFLE: {
+			for(int ai1=0; ai1<(int)mc.albums.size(); ai1++){
+				if((int)mc.weighted_album_order[ai1] == album_index_in_media){
+					set_album_seq_i(mc, ai1);
+					return;
+				}
+			}
+			return;
+		}
+		case TPM_GLOBAL_SHUFFLE: {
+			// Wherever the first track of the album is in the order
+			if(album_index_in_media < 0 || album_index_in_media >= (int)mc.albums.size() ||
+					mc.albums[album_index_in_media].tracks.empty())
+				return;
+			set_global_seq_i(mc, get_global_track_order(mc).inverse(
+					get_global_track_index(mc, album_index_in_media, 0)));
+			return;
+		}
 		case TPM_NORMAL:
 		case TPM_ALBUM_REPEAT:
 		case TPM_ALBUM_REPEAT_TRACK:
@@ -171,12 +242,23 @@ public:
 		if(mc.albums.empty())
 			return;
 		switch(track_progress_mode){
+		case TPM_GLOBAL_SHUFFLE: {
+			int album_index_in_media = album_i(mc);
+			const Album &album = mc.albums[album_index_in_media];
+			if(track_index_in_media < 0 || track_index_in_media >= (int)album.tracks.size()){
+				printf_("WARNING: track_index_in_media out of range\n");
+				return;
+			}
+			set_global_seq_i(mc, get_global_track_order(mc).inverse(
+					get_global_track_index(mc, album_index_in_media, track_index_in_media)));
+			return;
+		}
 		case TPM_SHUFFLE_TRACKS:
 		case TPM_SHUFFLE_ALL: {
 			const Album &album = mc.albums[album_i(mc)];
-			album.ensure_shuffled_track_order_exists();
+			const u32 *order = get_shuffled_track_order(mc, album_i(mc));
 			for(int ti1=0; ti1<(int)album.tracks.size(); ti1++){
-				if((int)album.shuffled_track_order[ti1] == track_index_in_media){
+				if((int)order[ti1] == track_index_in_media){
 					set_track_seq_i(mc, ti1);
 					return;
 				}
@@ -184,12 +266,15 @@ public:
 		}
 		case TPM_MR_SHUFFLE:
 		case TPM_SMART_ALBUM_SHUFFLE:
-		case TPM_SMART_TRACK_SHUFFLE: {
+		case TPM_SMART_TRACK_SHUFFLE:
+		case TPM_WEIGHTED_SHUFFLE: {
 			const Album &album = mc.albums[album_i(mc)];
 			if(album.shuffle_tracks_in_smart_mode){
-				album.ensure_shuffled_track_order_exists();
+				const u32 *order = track_progress_mode == TPM_WEIGHTED_SHUFFLE ?
+						get_weighted_track_order(mc, album_i(mc)) :
+						get_shuffled_track_order(mc, album_i(mc));
 				for(int ti1=0; ti1<(int)album.tracks.size(); ti1++){
-					if((int)album.shuffled_track_order[ti1] == track_index_in_media){
+					if((int)order[ti1] == track_index_in_media){
 						set_track_seq_i(mc, ti1);
 						return;
 					}
@@ -209,6 +294,15 @@ public:
 		}
 	}
 
+	// Points the cursor to where the album starts in the current order
+	void select_album_start_using_media_index(const MediaContent &mc,
+			int album_index_in_media)
+	{
+		select_album_using_media_index(mc, album_index_in_media);
+		if(track_progress_mode != TPM_GLOBAL_SHUFFLE)
+			track_seq_i = 0;
+	}
+
 	void set_track_progress_mode(const MediaContent &mc, TrackProgressMode new_tpm){
 		if(new_tpm == track_progress_mode)
 			return;
@@ -226,11 +320,11 @@ static Track get_track(const MediaContent &mc, const PlayCursor &cursor)
 		printf_("Album cursor overflow\n");
 		return Track();
 	}
-	const Album &album = mc.albums[cursor.album_i(mc)];
-	if(cursor.track_seq_i >= (int)album.tracks.size()){
+	if(cursor.track_seq_i >= cursor.seq_album_size(mc)){
 		printf_("Track cursor overflow\n");
 		return Track();
 	}
+	const Album &album = mc.albums[cursor.album_i(mc)];
 	return album.tracks[cursor.track_i(mc)];
 }
 
@@ -251,14 +345,12 @@ static void cursor_bound_wrap(const MediaContent &mc, PlayCursor &cursor)
 			cursor.track_seq_i = 0;
 		}
 	} else {
-		const Album &album = mc.albums[cursor.album_i(mc)];
 		if(cursor.track_seq_i < 0){
 			cursor.album_seq_i--;
 			if(cursor.album_seq_i < 0)
 				cursor.album_seq_i = mc.albums.size() - 1;
-			const Album &album2 = mc.albums[cursor.album_i(mc)];
-			cursor.track_seq_i = album2.tracks.size() - 1;
-		} else if(cursor.track_seq_i >= (int)album.tracks.size()){
+			cursor.track_seq_i = cursor.seq_album_size(mc) - 1;
+		} else if(cursor.track_seq_i >= cursor.seq_album_size(mc)){
 			cursor.track_seq_i = 0;
 			cursor.album_seq_i++;
 			if(cursor.album_seq_i >= (int)mc.albums.size())
@@ -283,16 +375,31 @@ static ss_ get_track_name(const MediaContent &mc, const PlayCursor &cursor)
 		printf_("Album cursor overflow\n");
 		return "ERR:AOVF";
 	}
-	const Album &album = mc.albums[cursor.album_i(mc)];
-	if(cursor.track_seq_i >= (int)album.tracks.size()){
+	if(cursor.track_seq_i >= cursor.seq_album_size(mc)){
 		printf_("Track cursor overflow\n");
 		return "ERR:TOVF";
 	}
+	const Album &album = mc.albums[cursor.album_i(mc)];
 	return album.tracks[cursor.track_i(mc)].display_name;
 }
 
+// Returns -1 if unknown
+static int get_cursor_progress_255(const PlayCursor &cursor)
+{
+	int progress;
+	if(cursor.duration > 0)
+		progress = cursor.time_pos * 255 / cursor.duration;
+	else if(cursor.stream_end > 0)
+		progress = cursor.stream_pos * 255 / cursor.stream_end;
+	else
+		return -1;
+	return progress < 0 ? 0 : progress > 255 ? 255 : progress;
+}
+
 static ss_ format_stream_pos(const PlayCursor &cursor)
 {
+	if(cursor.duration > 0)
+		return ss_()+itos(cursor.time_pos * 100 / cursor.duration)+"%";
 	if(cursor.stream_end == 0)
 		return "?";
 	return ss_()+itos(cursor.stream_pos * 100 / cursor.stream_end)+"%";
@@ -304,7 +411,13 @@ static ss_ get_cursor_info(const MediaContent &mc, const PlayCursor &cursor)
 		return "No media";
 
 	ss_ s;
-	if(cursor.track_progress_mode == TPM_SHUFFLE_ALL || cursor.track_progress_mode == TPM_MR_SHUFFLE){
+	if(cursor.track_progress_mode == TPM_GLOBAL_SHUFFLE){
+		s += "Track #"+itos(cursor.global_seq_i(mc)+1)+"/"+itos(get_total_tracks(mc))+
+				": Album #"+itos(cursor.album_i(mc)+1)+" ("+get_album_name(mc, cursor)+")"+
+				", track #"+itos(cursor.track_i(mc)+1)+
+				" ("+get_track_name(mc, cursor)+")"+" @ "+format_stream_pos(cursor);
+	} else if(cursor.track_progress_mode == TPM_SHUFFLE_ALL || cursor.track_progress_mode == TPM_MR_SHUFFLE ||
+			cursor.track_progress_mode == TPM_WEIGHTED_SHUFFLE){
 		s += "Album #"+itos(cursor.album_seq_i+1)+"="+itos(cursor.album_i(mc)+1)+
 				" ("+get_album_name(mc, cursor)+")"+
 				", track #"+itos(cursor.track_seq_i+1)+"="+itos(cursor.track_i(mc)+1)+
@@ -329,6 +442,16 @@ static bool resolve_track_from_current_album(const MediaContent &mc, PlayCursor
 	if(cursor.album_seq_i >= (int)mc.albums.size())
 		return false;
 	const Album &album = mc.albums[cursor.album_i(mc)];
+	if(cursor.track_progress_mode == TPM_GLOBAL_SHUFFLE){
+		// The album's tracks are spread over the whole order
+		for(size_t ti=0; ti<album.tracks.size(); ti++){
+			if(album.tracks[ti].display_name == cursor.track_name){
+				cursor.select_track_using_media_index(mc, ti);
+				return true;
+			}
+		}
+		return false;
+	}
 	PlayCursor cursor1 = cursor;
 	for(cursor1.track_seq_i=0; cursor1.track_seq_i<(int)album.tracks.size(); cursor1.track_seq_i++){
 		const Track &track = album.tracks[cursor1.track_i(mc)];
@@ -344,7 +467,11 @@ static bool resolve_track_from_current_album(const MediaContent &mc, PlayCursor
 static bool resolve_track_from_any_album(const MediaContent &mc, PlayCursor &cursor)
 {
 	PlayCursor cursor1 = cursor;
-	for(cursor1.album_seq_i=0; cursor1.album_seq_i<(int)mc.albums.size(); cursor1.album_seq_i++){
+	for(int ai=0; ai<(int)mc.albums.size(); ai++){
+		if(cursor1.track_progress_mode == TPM_GLOBAL_SHUFFLE)
+			cursor1.select_album_using_media_index(mc, ai);
+		else
+			cursor1.album_seq_i = ai;
 		bool found = resolve_track_from_current_album(mc, cursor1);
 		if(found){
 			cursor = cursor1;
@@ -354,6 +481,25 @@ static bool resolve_track_from_any_album(const MediaContent &mc, PlayCursor &cur
 	return false;
 }
 
+// Points the cursor to the track at path. Returns false if it's not there.
+static bool remap_cursor_to_path(const MediaContent &mc, PlayCursor &cursor,
+		const ss_ &path)
+{
+	if(path == "" || !mc.albums.library)
+		return false;
+	auto it = mc.albums.library->track_indices_by_path.find(path);
+	if(it == mc.albums.library->track_indices_by_path.end())
+		return false;
+	for(size_t i=0; i<mc.albums.indices.size(); i++){
+		if(mc.albums.indices[i] != it->second.first)
+			continue;
+		cursor.select_album_using_media_index(mc, i);
+		cursor.select_track_using_media_index(mc, it->second.second);
+		return true;
+	}
+	return false;
+}
+
 // Find track by the same name as near the cursor as possible. If failed, return
 // false and leave cursor as-is.
 static bool force_resolve_track(const MediaContent &mc, PlayCursor &cursor)
@@ -363,8 +509,11 @@ static bool force_resolve_track(const MediaContent &mc, PlayCursor &cursor)
 	// First find album
 	PlayCursor cursor1 = cursor;
 	bool album_found = false;
-	for(cursor1.album_seq_i=0; cursor1.album_seq_i<(int)mc.albums.size();
-			cursor1.album_seq_i++){
+	for(int ai=0; ai<(int)mc.albums.size(); ai++){
+		if(cursor1.track_progress_mode == TPM_GLOBAL_SHUFFLE)
+			cursor1.select_album_using_media_index(mc, ai);
+		else
+			cursor1.album_seq_i = ai;
 		const Album &album = mc.albums[cursor1.album_i(mc)];
 		if(album.name == cursor.album_name){
 			album_found = true;
@@ -383,7 +532,8 @@ static bool force_resolve_track(const MediaContent &mc, PlayCursor &cursor)
 		if(cursor.album_i(mc) < (int)mc.albums.size()){
 			const Album &album = mc.albums[cursor.album_i(mc)];
 			if(queued_album_shuffled_track_order.size() == album.tracks.size()){
-				album.shuffled_track_order = queued_album_shuffled_track_order;
+				set_track_order(mc, tpm_track_order_kind(cursor.track_progress_mode),
+						cursor.album_i(mc), queued_album_shuffled_track_order.data());
 				queued_album_shuffled_track_order.clear();
 			} else {
 				printf_("Applying queued album shuffled track order: track number mismatch\n");
@@ -0,0 +1,144 @@
+#include "play_history.hpp"
+#include "string_util.hpp"
+#include "stuff2.hpp"
+#include <fstream>
+#include <stdlib.h>
+
+static u32 fnv1a(const ss_ &s, u32 h = 2166136261u)
+{
+	for(char c : s){
+		h ^= (u8)c;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+u32 play_history_album_key(const ss_ &album_name)
+{
+	return fnv1a(album_name);
+}
+
+u32 play_history_track_key(const ss_ &album_name, const ss_ &track_name)
+{
+	return fnv1a(track_name, fnv1a("/", fnv1a(album_name)));
+}
+
+void play_history_record(PlayHistory &h, const ss_ &album_name, const ss_ &track_name)
+{
+	u32 album_key = play_history_album_key(album_name);
+	h.track_play_counts[play_history_track_key(album_name, track_name)]++;
+
+	// Only count an album once per continuous listen
+	if(!h.recent_albums.empty()){
+		size_t newest_i = (h.recent_albums_next_i + h.recent_albums.size() - 1) %
+				h.recent_albums.size();
+		if(h.recent_albums[newest_i] == album_key)
+			return;
+	}
+	h.album_play_counts[album_key]++;
+	if(h.recent_albums.size() < PlayHistory::RECENT_ALBUMS_MAX){
+		h.recent_albums.push_back(album_key);
+	} else {
+		h.recent_albums[h.recent_albums_next_i] = album_key;
+		h.recent_albums_next_i = (h.recent_albums_next_i + 1) %
+				h.recent_albums.size();
+	}
+}
+
+sm_<u32, size_t> play_history_recent_album_ages(const PlayHistory &h)
+{
+	sm_<u32, size_t> ages;
+	size_t n = h.recent_albums.size();
+	// Walk from oldest to newest so that the newest occurrence wins
+	for(size_t i=0; i<n; i++){
+		u32 key = h.recent_albums[(h.recent_albums_next_i + i) % n];
+		ages[key] = n - 1 - i;
+	}
+	return ages;
+}
+
+double play_history_album_weight(const PlayHistory &h,
+		const sm_<u32, size_t> &recent_album_ages, const ss_ &album_name)
+{
+	u32 key = play_history_album_key(album_name);
+	double weight = 1.0;
+	auto count_it = h.album_play_counts.find(key);
+	if(count_it != h.album_play_counts.end())
+		weight /= 1.0 + count_it->second;
+	auto age_it = recent_album_ages.find(key);
+	if(age_it != recent_album_ages.end()){
+		// Recently played albums are pushed heavily towards the end
+		double f = (double)(age_it->second + 1) / (PlayHistory::RECENT_ALBUMS_MAX + 1);
+		weight *= f * f;
+	}
+	return weight;
+}
+
+double play_history_track_weight(const PlayHistory &h, const ss_ &album_name,
+		const ss_ &track_name)
+{
+	auto it = h.track_play_counts.find(play_history_track_key(album_name, track_name));
+	if(it == h.track_play_counts.end())
+		return 1.0;
+	return 1.0 / (1.0 + it->second);
+}
+
+static void load_counts(sm_<u32, u32> &counts, const ss_ &line)
+{
+	Strfnd f(line);
+	while(!f.atend()){
+		ss_ key_s = f.next(":");
+		ss_ count_s = f.next(";");
+		if(key_s == "" || count_s == "")
+			continue;
+		counts[strtoul(key_s.c_str(), NULL, 16)] = strtoul(count_s.c_str(), NULL, 10);
+	}
+}
+
+bool play_history_load(PlayHistory &h, const ss_ &path)
+{
+	ss_ data;
+	if(!read_file_content(path, data))
+		return false;
+	h = PlayHistory();
+	Strfnd f(data);
+	Strfnd recent_f(f.next("\n"));
+	while(!recent_f.atend()){
+		ss_ key_s = recent_f.next(";");
+		if(key_s == "")
+			continue;
+		if(h.recent_albums.size() < PlayHistory::RECENT_ALBUMS_MAX)
+			h.recent_albums.push_back(strtoul(key_s.c_str(), NULL, 16));
+	}
+	load_counts(h.album_play_counts, f.next("\n"));
+	load_counts(h.track_play_counts, f.next("\n"));
+	return true;
+}
+
+static void save_counts(ss_ &blob, const sm_<u32, u32> &counts)
+{
+	char buf[30];
+	for(auto &pair : counts){
+		snprintf(buf, sizeof buf, "%x:%u;", pair.first, pair.second);
+		blob += buf;
+	}
+	blob += "\n";
+}
+
+void play_history_save(const PlayHistory &h, const ss_ &path)
+{
+	ss_ blob;
+	char buf[20];
+	// Recent albums are stored oldest first
+	size_t n = h.recent_albums.size();
+	for(size_t i=0; i<n; i++){
+		snprintf(buf, sizeof buf, "%x;", h.recent_albums[(h.recent_albums_next_i + i) % n]);
+		blob += buf;
+	}
+	blob += "\n";
+	save_counts(blob, h.album_play_counts);
+	save_counts(blob, h.track_play_counts);
+
+	std::ofstream f(path.c_str(), std::ios::binary);
+	f<<blob;
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include "types.hpp"
+
+// Remembers what has been played so that the weighted shuffle mode can avoid
+// repeating albums and tracks. Albums and tracks are identified by hashes of
+// their names so that the history survives remounting at a different path.
+// Tracks are named by file name, not by tag title; see
+// get_track_history_name().
+struct PlayHistory
+{
+	static const size_t RECENT_ALBUMS_MAX = 50;
+
+	sv_<u32> recent_albums; // Ring buffer of album hashes
+	size_t recent_albums_next_i = 0; // Oldest entry when the ring is full
+	sm_<u32, u32> album_play_counts;
+	sm_<u32, u32> track_play_counts;
+};
+
+u32 play_history_album_key(const ss_ &album_name);
+u32 play_history_track_key(const ss_ &album_name, const ss_ &track_name);
+void play_history_record(PlayHistory &h, const ss_ &album_name, const ss_ &track_name);
+// Map of album hash -> age (0 = most recently played)
+sm_<u32, size_t> play_history_recent_album_ages(const PlayHistory &h);
+double play_history_album_weight(const PlayHistory &h,
+		const sm_<u32, size_t> &recent_album_ages, const ss_ &album_name);
+double play_history_track_weight(const PlayHistory &h, const ss_ &album_name,
+		const ss_ &track_name);
+bool play_history_load(PlayHistory &h, const ss_ &path);
+void play_history_save(const PlayHistory &h, const ss_ &path);
+
+extern PlayHistory current_play_history;
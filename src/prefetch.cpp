@@ -0,0 +1,150 @@
+#include "prefetch.hpp"
+#include "print.hpp"
+#include "ui.hpp"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace prefetch {
+
+// Advised even when not reading; mpv probes roughly this much when opening
+static const size_t ADVISE_SIZE = 4 * 1024 * 1024;
+static const size_t READ_CHUNK_SIZE = 256 * 1024;
+
+static std::mutex mutex;
+static std::condition_variable cv;
+static ss_ requested_path;
+static u32 request_id = 0;
+static bool stop_requested = false;
+// Set while the worker has a file open; set_next("") waits for it to clear
+static bool file_open = false;
+static size_t read_size = 0;
+static std::thread worker;
+
+void set_read_size(size_t bytes)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	read_size = bytes;
+}
+
+static bool is_current(u32 id)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return id == request_id && !stop_requested;
+}
+
+static void set_file_closed()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		file_open = false;
+	}
+	cv.notify_all();
+}
+
+static void prefetch_file(const ss_ &path, u32 id, size_t bytes, sv_<u8> &buf)
+{
+	{
+		// Set before opening so that a cancel can't slip in between
+		std::lock_guard<std::mutex> lock(mutex);
+		if(id != request_id || stop_requested)
+			return;
+		file_open = true;
+	}
+	int fd = open(path.c_str(), O_RDONLY);
+	if(fd == -1){
+		printf_("Prefetch: Failed to open %s: %s\n", cs(path), strerror(errno));
+		set_file_closed();
+		return;
+	}
+	size_t advise_size = bytes > ADVISE_SIZE ? bytes : ADVISE_SIZE;
+#ifdef POSIX_FADV_WILLNEED
+	posix_fadvise(fd, 0, advise_size, POSIX_FADV_WILLNEED);
+#endif
+	// Reading makes sure the data is actually in the page cache by the time
+	// mpv opens the file; advising alone can be ignored
+	if(buf.size() < READ_CHUNK_SIZE)
+		buf.resize(READ_CHUNK_SIZE);
+	size_t done = 0;
+	while(done < bytes && is_current(id)){
+		size_t n = bytes - done < buf.size() ? bytes - done : buf.size();
+		ssize_t r = pread(fd, &buf[0], n, done);
+		if(r <= 0)
+			break;
+		done += r;
+	}
+	close(fd);
+	set_file_closed();
+	if(LOG_DEBUG)
+		printf_("Prefetched %zu bytes of %s\n", done, cs(path));
+}
+
+static void worker_main()
+{
+	// Reused for every file
+	sv_<u8> buf;
+	u32 handled_id = 0;
+	for(;;){
+		ss_ path;
+		u32 id;
+		size_t bytes;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			cv.wait(lock, [&]{ return stop_requested || request_id != handled_id; });
+			if(stop_requested)
+				return;
+			path = requested_path;
+			id = request_id;
+			bytes = read_size;
+		}
+		handled_id = id;
+		if(path != "")
+			prefetch_file(path, id, bytes, buf);
+	}
+}
+
+void start()
+{
+	if(worker.joinable())
+		return;
+	stop_requested = false;
+	worker = std::thread(worker_main);
+	static bool atexit_registered = false;
+	if(!atexit_registered){
+		atexit(stop);
+		atexit_registered = true;
+	}
+}
+
+void stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stop_requested = true;
+	}
+	cv.notify_all();
+	if(worker.joinable())
+		worker.join();
+}
+
+void set_next(const ss_ &path)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	if(path != requested_path){
+		requested_path = path;
+		request_id++;
+		cv.notify_all();
+	}
+	// The worker stops between reads of one chunk
+	if(path == "")
+		cv.wait(lock, []{ return !file_open; });
+}
+
+}
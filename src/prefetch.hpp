@@ -0,0 +1,16 @@
+#pragma once
+#include "types.hpp"
+
+// Reads the beginning of the next track ahead of time so that slow media
+// (synchronously mounted USB sticks) doesn't stall track changes.
+namespace prefetch
+{
+	// Amount of the file's head read through a reusable buffer into the page
+	// cache. 0 only advises the kernel to read ahead.
+	void set_read_size(size_t bytes);
+	void start();
+	void stop();
+	// Replaces any previous prefetch. An empty path cancels and returns once
+	// the previous file is closed (eg. before unmounting).
+	void set_next(const ss_ &path);
+}
@@ -3,6 +3,8 @@
 #pragma once
 #include <string>
 #include <vector>
+#include <string.h>
+#include <stdlib.h>
 
 class Strfnd {
 	std::string tek;
@@ -68,6 +70,118 @@ public:
 	}
 };
 
+// Non-owning reference to a piece of a string. The referenced data has to
+// outlive the StrRef.
+struct StrRef {
+	const char *ptr;
+	size_t len;
+
+	StrRef(): ptr(""), len(0){}
+	StrRef(const char *ptr, size_t len): ptr(ptr), len(len){}
+	StrRef(const char *s): ptr(s), len(strlen(s)){}
+	StrRef(const std::string &s): ptr(s.c_str()), len(s.size()){}
+
+	size_t size() const { return len; }
+	bool empty() const { return len == 0; }
+	char operator[](size_t i) const { return ptr[i]; }
+	std::string str() const { return std::string(ptr, len); }
+	StrRef substr(size_t pos, size_t n = std::string::npos) const {
+		if(pos > len)
+			pos = len;
+		if(n > len - pos)
+			n = len - pos;
+		return StrRef(ptr + pos, n);
+	}
+	size_t find(const StrRef &s, size_t pos = 0) const {
+		if(s.len > len)
+			return std::string::npos;
+		for(size_t i = pos; i + s.len <= len; i++){
+			if(memcmp(ptr + i, s.ptr, s.len) == 0)
+				return i;
+		}
+		return std::string::npos;
+	}
+};
+
+inline bool operator==(const StrRef &a, const StrRef &b){
+	return a.len == b.len && memcmp(a.ptr, b.ptr, a.len) == 0;
+}
+inline bool operator!=(const StrRef &a, const StrRef &b){
+	return !(a == b);
+}
+
+// Like Strfnd, but neither the input nor the results are copied
+class StrfndRef {
+	StrRef tek;
+	size_t p;
+public:
+	StrfndRef(const StrRef &s): tek(s), p(0){}
+	size_t where(){
+		return p;
+	}
+	void to(size_t i){
+		p = i;
+	}
+	StrRef what(){
+		return tek;
+	}
+	// Returns true if search_for was found
+	bool next(const StrRef &search_for, StrRef &result){
+		if(p >= tek.len)
+			return false;
+		size_t n = tek.find(search_for, p);
+		bool did_find = (n != std::string::npos);
+		if(n == std::string::npos || search_for.empty())
+			n = tek.len;
+		result = tek.substr(p, n - p);
+		p = n + search_for.len;
+		return did_find;
+	}
+	StrRef next(const StrRef &search_for){
+		StrRef result;
+		next(search_for, result);
+		return result;
+	}
+	StrRef while_any(const StrRef &chars){
+		if(chars.empty() || p >= tek.len)
+			return StrRef();
+		size_t n = p;
+		while(n < tek.len && memchr(chars.ptr, tek[n], chars.len))
+			n++;
+		StrRef result = tek.substr(p, n - p);
+		p = n;
+		return result;
+	}
+	bool atend(){
+		return p >= tek.len;
+	}
+};
+
+// Like stoi(ss_, int) and stof(ss_, double) in types.hpp
+inline int stoi(const StrRef &s, int default_v){
+	if(s.empty())
+		return default_v;
+	size_t i = 0;
+	while(i < s.len && (s[i] == ' ' || s[i] == '\t'))
+		i++;
+	bool negative = false;
+	if(i < s.len && (s[i] == '-' || s[i] == '+'))
+		negative = (s[i++] == '-');
+	int result = 0;
+	for(; i < s.len && s[i] >= '0' && s[i] <= '9'; i++)
+		result = result * 10 + (s[i] - '0');
+	return negative ? -result : result;
+}
+inline double stof(const StrRef &s, double default_v){
+	if(s.empty())
+		return default_v;
+	char buf[64];
+	size_t n = s.len < sizeof buf - 1 ? s.len : sizeof buf - 1;
+	memcpy(buf, s.ptr, n);
+	buf[n] = 0;
+	return atof(buf);
+}
+
 inline std::string trim(std::string str,
 		const std::string &whitespace = " \t\n\r")
 {
@@ -121,3 +235,38 @@ static void replace_string(ss_ &str, const ss_ &old_s, const ss_ &new_s){
 		i += new_s.length();
 	}
 }
+
+// Sort key for natural, case-insensitive ordering ("Track 2" < "Track 10")
+// with plain byte comparison. ASCII letters are lowercased and each run of
+// digits becomes '0', its length without leading zeros, and the digits, so
+// that shorter numbers sort first. Keys of names that differ only in leading
+// zeros or case are equal.
+static ss_ natural_sort_key(const char *s, size_t len)
+{
+	ss_ key;
+	key.reserve(len + 4);
+	size_t i = 0;
+	while(i < len){
+		char c = s[i];
+		if(c >= '0' && c <= '9'){
+			while(i + 1 < len && s[i] == '0' && s[i+1] >= '0' && s[i+1] <= '9')
+				i++;
+			size_t start = i;
+			while(i < len && s[i] >= '0' && s[i] <= '9')
+				i++;
+			size_t num_len = i - start < 255 ? i - start : 255;
+			key += '0';
+			key += (char)num_len;
+			key.append(s + start, num_len);
+			continue;
+		}
+		key += (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+		i++;
+	}
+	return key;
+}
+
+static ss_ natural_sort_key(const ss_ &s)
+{
+	return natural_sort_key(s.c_str(), s.size());
+}
@@ -18,13 +18,14 @@ static bool set_interface_attribs(int fd, int speed, int parity)
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "print.hpp"
 
 static bool set_interface_attribs(int fd, int speed, int parity)
 {
 	struct termios tty;
 	memset(&tty, 0, sizeof tty);
 	if(tcgetattr(fd, &tty) != 0){
-		printf("Error %d from tcgetattr\n", errno);
+		printf_("Error %d from tcgetattr\n", errno);
 		return false;
 	}
 
@@ -51,7 +52,7 @@ static bool set_interface_attribs(int fd, int speed, int parity)
 	tty.c_cflag &= ~CRTSCTS;
 
 	if(tcsetattr(fd, TCSANOW, &tty) != 0){
-		printf("Error %d from tcsetattr\n", errno);
+		printf_("Error %d from tcsetattr\n", errno);
 		return false;
 	}
 	return true;
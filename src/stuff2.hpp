@@ -14,18 +14,26 @@ static bool read_file_content(const ss_ &path, ss_ &result_data)
 
 #include <algorithm>
 
-static void create_shuffled_order(sv_<size_t> &shuffled_order, size_t n)
+// Orders are stored as u32 to halve their size; there are never 2^32 albums
+// or tracks
+static void create_shuffled_order(u32 *shuffled_order, size_t n)
 {
-	shuffled_order.resize(n);
 	for(size_t i=0; i<n; i++)
 		shuffled_order[i] = i;
-	std::random_shuffle(shuffled_order.begin(), shuffled_order.end());
+	std::random_shuffle(shuffled_order, shuffled_order + n);
+}
+
+static void create_shuffled_order(sv_<u32> &shuffled_order, size_t n)
+{
+	shuffled_order.resize(n);
+	if(n != 0)
+		create_shuffled_order(&shuffled_order[0], n);
 }
 
-static void create_mr_shuffled_order(sv_<size_t> &shuffled_order, size_t n)
+static void create_mr_shuffled_order(sv_<u32> &shuffled_order, size_t n)
 {
 	size_t n0 = (n + 4) / 5;
-	sv_<size_t> shuffled_order0;
+	sv_<u32> shuffled_order0;
 	create_shuffled_order(shuffled_order0, n0);
 	shuffled_order.clear();
 	shuffled_order.reserve(n);
@@ -38,3 +46,161 @@ static void create_mr_shuffled_order(sv_<size_t> &shuffled_order, size_t n)
 	}
 }
 
+static u64 create_random_key()
+{
+	u64 key = 0;
+	for(int i=0; i<4; i++)
+		key = (key << 16) ^ (u64)rand();
+	return key == 0 ? 1 : key;
+}
+
+// Pseudo-random permutation of [0, n) that is computed one element at a time
+// instead of being stored. A Feistel network is a bijection over the smallest
+// power of four >= n; values that land outside [0, n) are fed through again
+// until they don't (cycle walking), which keeps it a bijection over [0, n).
+struct KeyedPermutation
+{
+	u64 n = 0;
+	u64 key = 0;
+	int half_bits = 1;
+
+	void init(u64 n_, u64 key_)
+	{
+		n = n_;
+		key = key_;
+		half_bits = 1;
+		while(half_bits < 32 && ((u64)1 << (half_bits * 2)) < n)
+			half_bits++;
+	}
+
+	u64 forward(u64 i) const
+	{
+		if(n <= 1)
+			return 0;
+		do {
+			i = feistel(i, false);
+		} while(i >= n);
+		return i;
+	}
+
+	u64 inverse(u64 i) const
+	{
+		if(n <= 1)
+			return 0;
+		do {
+			i = feistel(i, true);
+		} while(i >= n);
+		return i;
+	}
+
+private:
+	static const int NUM_ROUNDS = 4;
+
+	u64 round_function(u64 x, int round) const
+	{
+		// splitmix64 finalizer
+		u64 z = x + key + (u64)(round + 1) * 0x9e3779b97f4a7c15ULL;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		return z ^ (z >> 31);
+	}
+
+	u64 feistel(u64 x, bool reverse) const
+	{
+		u64 mask = ((u64)1 << half_bits) - 1;
+		u64 l = x >> half_bits;
+		u64 r = x & mask;
+		if(!reverse){
+			for(int round=0; round<NUM_ROUNDS; round++){
+				u64 t = l ^ (round_function(r, round) & mask);
+				l = r;
+				r = t;
+			}
+		} else {
+			for(int round=NUM_ROUNDS-1; round>=0; round--){
+				u64 t = r ^ (round_function(l, round) & mask);
+				r = l;
+				l = t;
+			}
+		}
+		return (l << half_bits) | r;
+	}
+};
+
+// Binary indexed tree over non-negative weights. Supports O(log n) weight
+// updates and O(log n) lookup of the index at a given cumulative weight.
+struct FenwickTree
+{
+	sv_<double> tree; // 1-based
+	size_t top_step = 0; // Highest power of two <= size
+
+	void init(const sv_<double> &weights)
+	{
+		size_t n = weights.size();
+		tree.assign(n + 1, 0.0);
+		for(size_t i=1; i<=n; i++){
+			tree[i] += weights[i-1];
+			size_t parent = i + (i & (~i + 1));
+			if(parent <= n)
+				tree[parent] += tree[i];
+		}
+		top_step = 1;
+		while(top_step * 2 <= n)
+			top_step *= 2;
+	}
+
+	void add(size_t i, double delta)
+	{
+		for(i++; i<tree.size(); i += i & (~i + 1))
+			tree[i] += delta;
+	}
+
+	// Returns the 0-based index whose cumulative weight range contains value
+	size_t find(double value) const
+	{
+		size_t pos = 0;
+		for(size_t step = top_step; step != 0; step >>= 1){
+			if(pos + step < tree.size() && tree[pos + step] <= value){
+				pos += step;
+				value -= tree[pos];
+			}
+		}
+		return pos;
+	}
+};
+
+// Weighted random permutation; items with a larger weight tend to come
+// earlier. Every item is included regardless of its weight.
+static void create_weighted_order(u32 *order, sv_<double> weights)
+{
+	size_t n = weights.size();
+	double total = 0;
+	for(double &w : weights){
+		if(!(w >= 0.0001))
+			w = 0.0001;
+		total += w;
+	}
+	FenwickTree tree;
+	tree.init(weights);
+	for(size_t picked=0; picked<n; picked++){
+		double value = (double)rand() / ((double)RAND_MAX + 1.0) * total;
+		size_t i = tree.find(value);
+		// Floating point drift can land on an already picked item
+		if(i >= n || weights[i] == 0){
+			i = 0;
+			while(weights[i] == 0)
+				i++;
+		}
+		order[picked] = i;
+		tree.add(i, -weights[i]);
+		total -= weights[i];
+		weights[i] = 0;
+	}
+}
+
+static void create_weighted_order(sv_<u32> &order, const sv_<double> &weights)
+{
+	order.resize(weights.size());
+	if(!weights.empty())
+		create_weighted_order(&order[0], weights);
+}
@@ -0,0 +1,439 @@
+#include "transcode_cache.hpp"
+#include "metadata.hpp"
+#include "mkdir_p.hpp"
+#include "monotonic_time.hpp"
+#include "print.hpp"
+#include "ui.hpp"
+#include <mpv/client.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <deque>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sched.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <utime.h>
+
+namespace transcode_cache {
+
+static const char *CACHE_EXTENSION = ".mp3";
+static const char *TEMP_EXTENSION = ".tmp";
+static const size_t MAX_QUEUED = 32;
+// Sample rates above this are decoded from the cache if possible
+static const int HIRES_SAMPLE_RATE = 48000;
+// Share of all CPU time that has to be idle for a transcode to be started
+static const double MIN_IDLE_FRACTION = 0.5;
+static const int IDLE_SAMPLE_MS = 1000;
+static const int BUSY_RETRY_MS = 10000;
+// How long cancel() waits for a running encoder to close its files
+static const int CANCEL_TIMEOUT_MS = 5000;
+
+struct CacheEntry
+{
+	u64 size = 0;
+	time_t last_used = 0;
+};
+
+static std::mutex mutex;
+static std::condition_variable cv;
+static ss_ cache_dir;
+static u64 max_size = 1000ULL * 1024 * 1024;
+static sm_<ss_, CacheEntry> entries; // By file name in cache_dir
+static u64 total_size = 0;
+// Cache names of files that couldn't be transcoded; not retried
+static set_<ss_> failed_names;
+static std::deque<ss_> queued_paths; // Newest first
+static u32 cancel_id = 0;
+// Set while an encoder exists; cancel() waits for it to be destroyed
+static mpv_handle *running_encoder = NULL;
+static bool stop_requested = false;
+static std::thread worker;
+
+void set_directory(const ss_ &path)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	cache_dir = path;
+}
+
+void set_max_size(u64 bytes)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	max_size = bytes;
+}
+
+static bool is_current(u32 id)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return id == cancel_id && !stop_requested;
+}
+
+// Returns false if the cancel id changed or stop was requested
+static bool wait_ms(u32 id, int ms)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	cv.wait_for(lock, std::chrono::milliseconds(ms),
+			[&]{ return stop_requested || id != cancel_id; });
+	return id == cancel_id && !stop_requested;
+}
+
+// The name includes the source's size and modification time so that a
+// changed source doesn't match its old copy
+static bool get_cache_name(const ss_ &path, ss_ &result)
+{
+	struct stat st;
+	if(stat(path.c_str(), &st) != 0)
+		return false;
+	u64 h = 14695981039346656037ULL;
+	for(char c : path)
+		h = (h ^ (u8)c) * 1099511628211ULL;
+	char buf[80];
+	snprintf(buf, sizeof buf, "%016" PRIx64 "-%" PRIx64 "-%" PRIx64 "%s",
+			h, (u64)st.st_size, (u64)st.st_mtime, CACHE_EXTENSION);
+	result = buf;
+	return true;
+}
+
+static bool is_expensive(const ss_ &path, MediaFileType type)
+{
+	if(type == MFT_VIDEO)
+		return true;
+	size_t dot_i = path.rfind('.');
+	if(dot_i != ss_::npos){
+		ss_ ext = path.substr(dot_i + 1);
+		for(char &c : ext)
+			c = tolower(c);
+		if(ext == "wma" || ext == "ra" || ext == "ram")
+			return true;
+	}
+	TrackMetadata md;
+	return metadata_cache::get(path, md) && md.sample_rate > HIRES_SAMPLE_RATE;
+}
+
+// Has to be called with mutex locked
+static void evict_to_fit()
+{
+	while(total_size > max_size && !entries.empty()){
+		auto oldest = entries.begin();
+		for(auto it = entries.begin(); it != entries.end(); ++it){
+			if(it->second.last_used < oldest->second.last_used)
+				oldest = it;
+		}
+		if(LOG_DEBUG)
+			printf_("Transcode cache: Evicting %s\n", cs(oldest->first));
+		unlink((cache_dir+"/"+oldest->first).c_str());
+		total_size -= oldest->second.size;
+		entries.erase(oldest);
+	}
+}
+
+static bool ends_with(const char *s, const char *suffix)
+{
+	size_t len = strlen(s);
+	size_t suffix_len = strlen(suffix);
+	return len >= suffix_len && strcmp(s + len - suffix_len, suffix) == 0;
+}
+
+// The modification times of the copies are their last use times
+static void load_entries()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	entries.clear();
+	total_size = 0;
+	DIR *dir = opendir(cache_dir.c_str());
+	if(dir == NULL){
+		printf_("Transcode cache: Failed to open %s: %s\n", cs(cache_dir),
+				strerror(errno));
+		return;
+	}
+	struct dirent *de;
+	while((de = readdir(dir)) != NULL){
+		ss_ path = cache_dir+"/"+de->d_name;
+		if(ends_with(de->d_name, TEMP_EXTENSION)){
+			// Left over from an interrupted transcode
+			unlink(path.c_str());
+			continue;
+		}
+		if(!ends_with(de->d_name, CACHE_EXTENSION))
+			continue;
+		struct stat st;
+		if(stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+			continue;
+		CacheEntry &entry = entries[de->d_name];
+		entry.size = st.st_size;
+		entry.last_used = st.st_mtime;
+		total_size += entry.size;
+	}
+	closedir(dir);
+	printf_("Transcode cache: %zu files, %.1f MB\n", entries.size(),
+			total_size / 1048576.0);
+	evict_to_fit();
+}
+
+// Returns false if unavailable
+static bool read_cpu_times(u64 &idle, u64 &total)
+{
+	FILE *f = fopen("/proc/stat", "r");
+	if(f == NULL)
+		return false;
+	unsigned long long v[8] = {0};
+	int n = fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+			&v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]);
+	fclose(f);
+	if(n < 4)
+		return false;
+	idle = v[3] + v[4]; // idle + iowait
+	total = 0;
+	for(int i=0; i<8; i++)
+		total += v[i];
+	return true;
+}
+
+// Returns false if the cancel id changed or stop was requested
+static bool wait_for_cpu_headroom(u32 id)
+{
+	for(;;){
+		u64 idle0, total0, idle1, total1;
+		if(!read_cpu_times(idle0, total0))
+			return is_current(id);
+		if(!wait_ms(id, IDLE_SAMPLE_MS))
+			return false;
+		if(!read_cpu_times(idle1, total1))
+			return is_current(id);
+		if(total1 > total0 &&
+				(double)(idle1 - idle0) / (total1 - total0) >= MIN_IDLE_FRACTION)
+			return true;
+		if(LOG_DEBUG)
+			printf_("Transcode cache: CPU busy; waiting\n");
+		if(!wait_ms(id, BUSY_RETRY_MS))
+			return false;
+	}
+}
+
+// Threads that mpv creates from this thread inherit these, so playback always
+// takes precedence over transcoding
+static void lower_thread_priority()
+{
+#ifdef SCHED_IDLE
+	struct sched_param param;
+	param.sched_priority = 0;
+	sched_setscheduler(0, SCHED_IDLE, &param);
+#endif
+	// On Linux this only applies to the calling thread
+	setpriority(PRIO_PROCESS, 0, 19);
+}
+
+// Returns false if the transcode failed or was aborted
+static bool transcode(const ss_ &src_path, const ss_ &dst_path, u32 id)
+{
+	mpv_handle *encoder = mpv_create();
+	if(encoder == NULL)
+		return false;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if(id != cancel_id || stop_requested){
+			mpv_terminate_destroy(encoder);
+			return false;
+		}
+		running_encoder = encoder;
+	}
+	mpv_set_option_string(encoder, "o", dst_path.c_str());
+	mpv_set_option_string(encoder, "of", "mp3");
+	mpv_set_option_string(encoder, "oac", "libmp3lame");
+	mpv_set_option_string(encoder, "oacopts", "b=192k");
+	mpv_set_option_string(encoder, "vid", "no");
+	mpv_set_option_string(encoder, "sid", "no");
+	bool ok = false;
+	if(mpv_initialize(encoder) >= 0){
+		const char *cmd[] = {"loadfile", src_path.c_str(), NULL};
+		if(mpv_command(encoder, cmd) >= 0){
+			while(is_current(id)){
+				mpv_event *event = mpv_wait_event(encoder, 0.5);
+				if(event->event_id == MPV_EVENT_END_FILE){
+					mpv_event_end_file *end = (mpv_event_end_file*)event->data;
+					ok = (end->reason == MPV_END_FILE_REASON_EOF);
+					break;
+				}
+				if(event->event_id == MPV_EVENT_SHUTDOWN)
+					break;
+			}
+		}
+	}
+	// The output file is finalized and the source is closed here
+	mpv_terminate_destroy(encoder);
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		running_encoder = NULL;
+	}
+	cv.notify_all();
+	return ok && is_current(id);
+}
+
+static void handle_queued_path(const ss_ &path, u32 id)
+{
+	ss_ name;
+	if(!get_cache_name(path, name))
+		return;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if(entries.count(name) || failed_names.count(name))
+			return;
+	}
+	ss_ cached_path = cache_dir+"/"+name;
+	ss_ temp_path = cached_path+TEMP_EXTENSION;
+	int64_t start_ms = get_monotonic_ms();
+	bool ok = transcode(path, temp_path, id);
+	struct stat st;
+	if(ok && (stat(temp_path.c_str(), &st) != 0 || st.st_size == 0))
+		ok = false;
+	if(ok && rename(temp_path.c_str(), cached_path.c_str()) != 0)
+		ok = false;
+	if(!ok){
+		unlink(temp_path.c_str());
+		if(is_current(id)){
+			printf_("Transcode cache: Failed to transcode %s\n", cs(path));
+			std::lock_guard<std::mutex> lock(mutex);
+			failed_names.insert(name);
+		}
+		return;
+	}
+	printf_("Transcode cache: Transcoded %s in %.1fs\n", cs(path),
+			(get_monotonic_ms() - start_ms) / 1000.0);
+	std::lock_guard<std::mutex> lock(mutex);
+	CacheEntry &entry = entries[name];
+	entry.size = st.st_size;
+	entry.last_used = time(0);
+	total_size += entry.size;
+	evict_to_fit();
+}
+
+static void worker_main()
+{
+	lower_thread_priority();
+	load_entries();
+	for(;;){
+		u32 id;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			cv.wait(lock, []{ return stop_requested || !queued_paths.empty(); });
+			if(stop_requested)
+				return;
+			id = cancel_id;
+		}
+		if(!wait_for_cpu_headroom(id))
+			continue;
+		ss_ path;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if(id != cancel_id || queued_paths.empty())
+				continue;
+			path = queued_paths.front();
+			queued_paths.pop_front();
+		}
+		handle_queued_path(path, id);
+	}
+}
+
+void start()
+{
+	if(worker.joinable() || cache_dir == "")
+		return;
+	if(mkdir_p(cache_dir.c_str()) != 0){
+		printf_("Transcode cache: Failed to create %s\n", cs(cache_dir));
+		return;
+	}
+	stop_requested = false;
+	worker = std::thread(worker_main);
+	static bool atexit_registered = false;
+	if(!atexit_registered){
+		atexit(stop);
+		atexit_registered = true;
+	}
+}
+
+void stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stop_requested = true;
+		if(running_encoder)
+			mpv_wakeup(running_encoder);
+	}
+	cv.notify_all();
+	if(worker.joinable())
+		worker.join();
+}
+
+void queue(const ss_ &path, MediaFileType type)
+{
+	if(!worker.joinable() || !is_expensive(path, type))
+		return;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for(auto it = queued_paths.begin(); it != queued_paths.end(); ++it){
+			if(*it == path){
+				queued_paths.erase(it);
+				break;
+			}
+		}
+		queued_paths.push_front(path);
+		if(queued_paths.size() > MAX_QUEUED)
+			queued_paths.pop_back();
+	}
+	cv.notify_all();
+}
+
+void cancel()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	queued_paths.clear();
+	cancel_id++;
+	cv.notify_all();
+	if(running_encoder == NULL)
+		return;
+	// Interrupts the worker's mpv_wait_event()
+	mpv_wakeup(running_encoder);
+	if(!cv.wait_for(lock, std::chrono::milliseconds(CANCEL_TIMEOUT_MS),
+			[]{ return running_encoder == NULL; }))
+		printf_("Transcode cache: Encoder didn't stop in time\n");
+}
+
+ss_ get_playable_path(const ss_ &path)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if(entries.empty())
+			return path;
+	}
+	ss_ name;
+	if(!get_cache_name(path, name))
+		return path;
+	ss_ cached_path;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = entries.find(name);
+		if(it == entries.end())
+			return path;
+		cached_path = cache_dir+"/"+name;
+		if(access(cached_path.c_str(), R_OK) != 0){
+			// Removed from outside
+			total_size -= it->second.size;
+			entries.erase(it);
+			return path;
+		}
+		it->second.last_used = time(0);
+	}
+	// Keeps the use order over restarts
+	utime(cached_path.c_str(), NULL);
+	return cached_path;
+}
+
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include "types.hpp"
+#include "media_types.hpp"
+
+// Keeps cheap-to-decode MP3 copies of files that cost a lot of CPU to decode
+// (video containers, WMA, RealAudio, hi-res audio) in a size-bounded
+// directory, evicting the least recently played copies first. The copies are
+// made by a second mpv instance in encoding mode. It runs in a background
+// thread at idle CPU priority, and a file is only started while there's CPU
+// headroom.
+namespace transcode_cache
+{
+	// The cache is disabled unless a directory is set before start()
+	void set_directory(const ss_ &path);
+	void set_max_size(u64 bytes);
+	void start();
+	void stop();
+	// Queues the file if it's expensive to decode. The most recently queued
+	// files are transcoded first.
+	void queue(const ss_ &path, MediaFileType type);
+	// Drops queued files and aborts a running transcode (eg. before unmounting).
+	// Returns once the encoder has closed the source file.
+	void cancel();
+	// Path of the cached copy if there is one; otherwise path itself
+	ss_ get_playable_path(const ss_ &path);
+}
@@ -0,0 +1,103 @@
+#include "uevent.hpp"
+#include "print.hpp"
+#ifndef __WIN32__
+#  include <sys/types.h>
+#  include <sys/socket.h>
+#  include <linux/netlink.h>
+#  include <unistd.h>
+#  include <string.h>
+#  include <errno.h>
+#endif
+
+namespace uevent {
+
+static int fd = -1;
+
+#ifdef __WIN32__
+bool init()
+{
+	return false;
+}
+#else
+bool init()
+{
+	if(fd != -1)
+		return true;
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			NETLINK_KOBJECT_UEVENT);
+	if(fd == -1){
+		printf_("uevent: socket() failed: %s\n", strerror(errno));
+		return false;
+	}
+	// Plugging in a hub can generate a burst of events
+	int rcvbuf = 256 * 1024;
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+
+	struct sockaddr_nl addr;
+	memset(&addr, 0, sizeof addr);
+	addr.nl_family = AF_NETLINK;
+	addr.nl_pid = 0; // Assigned by kernel
+	addr.nl_groups = 1; // Kernel events (as opposed to udev's)
+	if(bind(fd, (struct sockaddr*)&addr, sizeof addr) == -1){
+		printf_("uevent: bind() failed: %s\n", strerror(errno));
+		close(fd);
+		fd = -1;
+		return false;
+	}
+	return true;
+}
+#endif
+
+bool is_available()
+{
+	return fd != -1;
+}
+
+#ifdef __WIN32__
+sv_<Event> read_events()
+{
+	return sv_<Event>();
+}
+#else
+sv_<Event> read_events()
+{
+	sv_<Event> result;
+	if(fd == -1)
+		return result;
+	// A message is "action@devpath" followed by KEY=value fields, all
+	// terminated by NUL
+	char buf[8192];
+	for(;;){
+		ssize_t len = recv(fd, buf, sizeof buf - 1, 0);
+		if(len < 0){
+			if(errno == ENOBUFS){
+				// Events were lost; report a change so that the caller rescans
+				printf_("uevent: Receive buffer overflow\n");
+				Event event;
+				event.action = "change";
+				event.subsystem = "block";
+				result.push_back(event);
+				continue;
+			}
+			break;
+		}
+		buf[len] = 0;
+		Event event;
+		for(ssize_t i = strlen(buf) + 1; i < len; i += strlen(buf + i) + 1){
+			const char *field = buf + i;
+			if(strncmp(field, "ACTION=", 7) == 0)
+				event.action = field + 7;
+			else if(strncmp(field, "SUBSYSTEM=", 10) == 0)
+				event.subsystem = field + 10;
+			else if(strncmp(field, "DEVNAME=", 8) == 0)
+				event.devname = field + 8;
+		}
+		if(event.action == "" || event.subsystem == "")
+			continue;
+		result.push_back(event);
+	}
+	return result;
+}
+#endif
+
+}
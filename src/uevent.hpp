@@ -0,0 +1,19 @@
+#pragma once
+#include "types.hpp"
+
+// Kernel hotplug events (NETLINK_KOBJECT_UEVENT)
+namespace uevent
+{
+	struct Event {
+		ss_ action; // add, remove, change, ...
+		ss_ subsystem; // block, tty, ...
+		ss_ devname; // eg. sdc1, ttyUSB0; empty for devices without a node
+	};
+
+	// Returns false if the socket can't be opened; the caller should fall
+	// back to polling
+	bool init();
+	bool is_available();
+	// Non-blocking; returns events received since the last call
+	sv_<Event> read_events();
+}
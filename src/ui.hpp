@@ -7,15 +7,29 @@ extern sv_<ss_> arduino_serial_paths;
 extern sv_<ss_> track_devices;
 extern int arduino_display_width;
 extern bool minimize_display_updates;
+extern int display_piece_ms;
 extern time_t startup_timestamp;
 extern bool do_main_loop;
 extern ss_ current_collection_part;
 extern bool queued_pause;
 extern sv_<ss_> static_media_paths;
+extern bool use_tag_track_names;
 
-extern set_<ss_> enabled_log_sources;
-#define LOG_MPV enabled_log_sources.count("mpv")
-#define LOG_DEBUG enabled_log_sources.count("debug")
+// Resolved from -l once at startup so that checks in the main loop are a
+// single AND. Build with eg. -DCOMPILED_LOG_SOURCES=0 to have the compiler
+// drop disabled log statements entirely.
+enum LogSource {
+	LOG_SOURCE_MPV = 1<<0,
+	LOG_SOURCE_DEBUG = 1<<1,
+};
+#ifndef COMPILED_LOG_SOURCES
+#  define COMPILED_LOG_SOURCES (LOG_SOURCE_MPV | LOG_SOURCE_DEBUG)
+#endif
+extern u32 enabled_log_sources;
+#define LOG_SOURCE_ENABLED(source) \
+		((COMPILED_LOG_SOURCES & (source)) && (enabled_log_sources & (source)))
+#define LOG_MPV LOG_SOURCE_ENABLED(LOG_SOURCE_MPV)
+#define LOG_DEBUG LOG_SOURCE_ENABLED(LOG_SOURCE_DEBUG)
 
 void save_stuff();
 void temp_display_album();
@@ -36,5 +50,6 @@ void command_random_album();
 void command_random_album_approx_num_tracks(size_t approx_num_tracks);
 void command_random_album_min_num_tracks(size_t min_num_tracks);
 void command_random_album_max_num_tracks(size_t max_num_tracks);
+void command_random_album_approx_duration(double approx_minutes);
 void command_random_track();
 
@@ -1,15 +1,39 @@
 #include "ui_output_queue.hpp"
+#include "monotonic_time.hpp"
 #include "types.hpp"
 #include "print.hpp"
 
 namespace ui_output_queue {
 
-static sv_<Message> message_queue;
-bool message_queue_is_unimportant = false;
+static const size_t RING_CAPACITY = 8;
+
+// Fixed-size FIFO. Popped slots keep their string buffers for reuse.
+struct MessageRing {
+	Message slots[RING_CAPACITY];
+	size_t head = 0;
+	size_t count = 0;
+
+	Message& at(size_t i){
+		return slots[(head + i) % RING_CAPACITY];
+	}
+	void pop_front(){
+		head = (head + 1) % RING_CAPACITY;
+		count--;
+	}
+	void clear(){
+		head = 0;
+		count = 0;
+	}
+};
+
+static MessageRing message_rings[MP_NUM_PRIORITIES];
+static uint32_t next_message_id = 1;
+static bool message_queue_is_unimportant = false;
 
 void clear_messages()
 {
-	message_queue.clear();
+	for(MessageRing &ring : message_rings)
+		ring.clear();
 }
 
 void unprioritize_queue()
@@ -17,29 +41,62 @@ void unprioritize_queue()
 	message_queue_is_unimportant = true;
 }
 
-void push_message(const ss_ &text, const ss_ &short_text)
+void push_message(const ss_ &text, const ss_ &short_text,
+		MessagePriority priority, int lifetime_ms)
 {
 	if(message_queue_is_unimportant)
 		clear_messages();
 	message_queue_is_unimportant = false;
-	message_queue.push_back(Message(text, short_text));
+
+	const ss_ &actual_short_text = short_text.empty() ? text : short_text;
+	int64_t expire_ms = get_monotonic_ms() + lifetime_ms;
+	MessageRing &ring = message_rings[priority];
+
+	for(size_t i=0; i<ring.count; i++){
+		Message &m = ring.at(i);
+		if(m.text == text && m.short_text == actual_short_text){
+			m.expire_ms = expire_ms;
+			return;
+		}
+	}
+
+	// Any new message supersedes a status update
+	message_rings[MP_LOW].clear();
+	if(ring.count == RING_CAPACITY)
+		ring.pop_front(); // Drop the stalest message
+
+	Message &m = ring.at(ring.count);
+	ring.count++;
+	m.id = next_message_id++;
+	if(next_message_id == 0)
+		next_message_id = 1;
+	m.text = text;
+	m.short_text = actual_short_text;
+	m.priority = priority;
+	m.expire_ms = expire_ms;
 }
 
-Message get_message()
+const Message* peek_message()
 {
-	if(message_queue.empty())
-		return Message();
-	return message_queue[0];
+	int64_t now = get_monotonic_ms();
+	for(int p = MP_NUM_PRIORITIES - 1; p >= 0; p--){
+		MessageRing &ring = message_rings[p];
+		while(ring.count > 0 && ring.at(0).expire_ms <= now)
+			ring.pop_front();
+		if(ring.count > 0)
+			return &ring.at(0);
+	}
+	return NULL;
 }
 
-void pop_message()
+void pop_message(uint32_t id)
 {
-	if(message_queue.empty()){
-		fprintf_(stderr, "ERROR: pop_message(): Queue is already empty\n");
-		return;
+	for(MessageRing &ring : message_rings){
+		if(ring.count > 0 && ring.at(0).id == id){
+			ring.pop_front();
+			return;
+		}
 	}
-	message_queue.erase(message_queue.begin(), message_queue.begin()+1);
 }
 
-
 } // namespace ui_output_queue
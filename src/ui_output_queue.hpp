@@ -1,23 +1,44 @@
 #pragma once
 #include "types.hpp"
+#include <stdint.h>
 
 namespace ui_output_queue
 {
+	enum MessagePriority {
+		// Status updates (eg. scan progress). Only the latest one is kept, and
+		// it is discarded when any other message is pushed.
+		MP_LOW,
+		MP_NORMAL,
+		MP_HIGH,
+
+		MP_NUM_PRIORITIES,
+	};
+
 	struct Message {
+		uint32_t id = 0; // Unique among queued messages
 		ss_ text;
 		ss_ short_text; // For small LCD
-
-		Message(const ss_ &text="", const ss_ &short_text=""):
-			text(text), short_text(short_text.empty() ? text : short_text)
-		{}
+		MessagePriority priority = MP_NORMAL;
+		int64_t expire_ms = 0; // Monotonic; see get_monotonic_ms()
 	};
 
+	// Messages not yet shown by this time are considered stale and dropped
+	static const int DEFAULT_MESSAGE_LIFETIME_MS = 10000;
+
 	void clear_messages();
 	// Called when a user interaction happens; causes the next push_message()
 	// to call clear_messages() before pushing the message.
 	// TODO: Call this from hwcontrol
 	void unprioritize_queue();
-	void push_message(const ss_ &text, const ss_ &short_text="");
-	Message get_message();
-	void pop_message();
+	// An identical pending message is refreshed instead of being queued
+	// again. When the queue of a priority level is full, its oldest message is
+	// dropped.
+	void push_message(const ss_ &text, const ss_ &short_text="",
+			MessagePriority priority=MP_NORMAL,
+			int lifetime_ms=DEFAULT_MESSAGE_LIFETIME_MS);
+	// Returns the oldest unexpired message of the highest priority, or NULL.
+	// The pointer is valid until the queue is modified.
+	const Message* peek_message();
+	// Removes the message if it is still queued
+	void pop_message(uint32_t id);
 };